@@ -1,6 +1,7 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -9,6 +10,7 @@
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
@@ -83,7 +85,7 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
         next_cmd = next_cmd->next;
     }
 
-    cmd_element_t *cmd = malloc_or_fail(sizeof(cmd_element_t), "add_cmd");
+    cmd_element_t *cmd = calloc_or_fail(1, sizeof(cmd_element_t), "add_cmd");
     cmd->name = name;
     cmd->operation = operation;
     cmd->summary = summary;
@@ -159,6 +161,20 @@ static char **parse_args(char *line, int *argcp)
     return argv;
 }
 
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void profile_record(cmd_element_t *cmd, uint64_t ns)
+{
+    if (!cmd->profile)
+        cmd->profile = calloc_or_fail(1, sizeof(hist_t), "profile_record");
+    hist_record(cmd->profile, ns);
+}
+
 static void record_error()
 {
     err_cnt++;
@@ -179,7 +195,11 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        uint64_t start = now_ns();
         ok = next_cmd->operation(argc, argv);
+        /* quit frees the command list, this element included */
+        if (!quit_flag)
+            profile_record(next_cmd, now_ns() - start);
         if (!ok)
             record_error();
     } else {
@@ -230,6 +250,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->profile)
+            free_block(ele->profile, sizeof(hist_t));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -296,6 +318,19 @@ bool get_int(char *vname, int *loc)
     return true;
 }
 
+/* Extract long integer from text and store at loc */
+bool get_long(char *vname, long *loc)
+{
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(vname, &end, 0);
+    if (errno || end == vname || *end != '\0')
+        return false;
+
+    *loc = v;
+    return true;
+}
+
 static bool do_option(int argc, char *argv[])
 {
     if (argc == 1) {
@@ -392,6 +427,62 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Commands with the most time spent in them first */
+static int cmp_profile_total(const void *a, const void *b)
+{
+    const hist_t *pa = (*(cmd_element_t *const *) a)->profile;
+    const hist_t *pb = (*(cmd_element_t *const *) b)->profile;
+    return (pa->total < pb->total) - (pa->total > pb->total);
+}
+
+static bool do_profile(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+        report(1, "Usage: profile [reset]");
+        return false;
+    }
+
+    if (argc == 2) {
+        for (cmd_element_t *c = cmd_list; c; c = c->next) {
+            if (c->profile)
+                hist_reset(c->profile);
+        }
+        return true;
+    }
+
+    int n = 0;
+    for (cmd_element_t *c = cmd_list; c; c = c->next)
+        n += c->profile && c->profile->count;
+    if (!n) {
+        report(1, "No commands profiled");
+        return true;
+    }
+
+    cmd_element_t **sorted =
+        malloc_or_fail(n * sizeof(cmd_element_t *), "do_profile");
+    n = 0;
+    for (cmd_element_t *c = cmd_list; c; c = c->next)
+        if (c->profile && c->profile->count)
+            sorted[n++] = c;
+    qsort(sorted, n, sizeof(cmd_element_t *), cmp_profile_total);
+
+    report(1, "%-12s%10s%12s%10s%10s%10s%10s%10s", "command", "count",
+           "total(ms)", "min(us)", "p50(us)", "p99(us)", "p999(us)",
+           "max(us)");
+    for (int i = 0; i < n; i++) {
+        const hist_t *prof = sorted[i]->profile;
+        report(1, "%-12s%10lu%12.3f%10.1f%10.1f%10.1f%10.1f%10.1f",
+               sorted[i]->name, (unsigned long) prof->count,
+               prof->total / 1e6, prof->min / 1e3,
+               hist_quantile(prof, 0.5) / 1e3,
+               hist_quantile(prof, 0.99) / 1e3,
+               hist_quantile(prof, 0.999) / 1e3, prof->max / 1e3);
+    }
+    free_block(sorted, n * sizeof(cmd_element_t *));
+
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd = -1;
 
@@ -430,6 +521,8 @@ void init_cmd()
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(profile, "Show or clear latency statistics per command",
+                "[reset]");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("ai_mode", &ai_mode, "Start/Stop AI vs AI mode", NULL);
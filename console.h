@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <sys/select.h>
 
+#include "hist.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -25,6 +26,7 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    hist_t *profile; /* nanoseconds of each run, allocated on the first */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -54,6 +56,9 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Extract long integer from text and store at loc */
+bool get_long(char *vname, long *loc);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
@@ -1,12 +1,25 @@
 /* Test support code */
 
+/* dladdr() is a GNU extension */
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h> /* malloc_trim */
+#endif
 
+#include "perf.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -29,48 +42,997 @@
 
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
-    size_t payload_size;
+    union {
+        size_t payload_size;
+        struct __block_element *next_free; /* while on a pool free list */
+    };
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Blocks of up to POOL_MAX_BLOCK bytes, header and footer included, are
+ * carved out of chunks of POOL_CHUNK bytes, with one size class for every
+ * multiple of POOL_ALIGN. Each thread caches up to CACHE_BLOCKS free blocks
+ * per class, which it allocates from and frees to without taking a lock, and
+ * trades batches of CACHE_BATCH blocks with the shared free list of the
+ * class. Chunks are aligned to their size, so the chunk of a block is found
+ * by masking its address, and a bitmap in the chunk tells which of its blocks
+ * are allocated.
+ */
+#define POOL_ALIGN 16
+#define POOL_MAX_BLOCK 512
+#define POOL_CLASSES (POOL_MAX_BLOCK / POOL_ALIGN)
+#define POOL_CHUNK (64 * 1024)
+#define CACHE_BLOCKS 64
+#define CACHE_BATCH (CACHE_BLOCKS / 2)
+
+/* Even an empty block holds a header and a footer, 32 bytes once aligned */
+#define CHUNK_BLOCKS (POOL_CHUNK / (2 * POOL_ALIGN))
+
+typedef struct pool_chunk {
+    struct pool_chunk *next;
+    uint32_t cls;
+    uint32_t inverse; /* 2^32 / block size, rounded up */
+    uint64_t bitmap[CHUNK_BLOCKS / 64]; /* Allocated, under the shard lock */
+
+    /* Blocks on the shared free list, only counted by pool_trim() */
+    size_t idle;
+    uint64_t pooled[CHUNK_BLOCKS / 64];
+} pool_chunk_t;
+
+/* Marks a block placed against a guard page, past the pooled and large ones */
+#define GUARD_CLASS (POOL_CLASSES + 1)
+
+/* Offset of the first block in a chunk */
+#define CHUNK_START \
+    ((sizeof(pool_chunk_t) + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1))
+
+/* Free blocks, chunks, and the free space of the newest chunk of a class */
+static struct {
+    block_element_t *free;
+    pool_chunk_t *chunks;
+    unsigned char *bump, *limit;
+} pools[POOL_CLASSES];
+
+/* Guards the pools, and the fields of chunks other than the allocated bitmap */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Free blocks cached by the calling thread, handed back when it exits */
+static __thread struct {
+    block_element_t *free;
+    unsigned count;
+} cache[POOL_CLASSES];
+static __thread bool cache_registered = false;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * block_set_t - Open-addressing hash set of addresses
+ * @slots: table of 2^@bits slots, NULL for an empty slot
+ * @bits: log2 of the table size, 0 before the first insertion
+ * @count: number of addresses in the set
+ * @tagged: whether each address carries a tag, kept in @tags
+ * @tags: table parallel to @slots
+ *
+ * Slots are probed linearly and the table is kept at most half full. Removal
+ * shifts the entries behind the freed slot back instead of leaving
+ * tombstones, so lookups stay short.
+ */
+typedef struct {
+    const void **slots;
+    unsigned bits;
+    size_t count;
+    bool tagged;
+    uint32_t *tags;
+} block_set_t;
+
+#define BLOCK_SET_MIN_BITS 10
+
+/* Allocated blocks are tracked in SHARDS shards with a lock each, so that
+ * threads working on different memory rarely wait for each other. A block
+ * belongs to the shard of the POOL_CHUNK-aligned window holding its header,
+ * which for a pooled block is its chunk. Blocks too large for the pools and
+ * guarded blocks are checked and removed on free through sets of their
+ * headers, and pooled blocks through the set of chunks and the chunk bitmaps,
+ * all in constant time.
+ */
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_set_t large_blocks, guarded_blocks, chunks;
+    size_t allocated_count;
+} shard_t;
+
+static shard_t shards[SHARDS] = {
+    [0 ... SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/* Number of harness locks the calling thread holds. Jumping out of a critical
+ * section on a timeout would leave its lock held, so the exception is
+ * deferred until the last of them is released.
+ */
+static __thread volatile sig_atomic_t in_allocator = 0;
+static __thread volatile sig_atomic_t exception_deferred = false;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+/* Fill 1 in poison_rate blocks when allocated and freed, none if 0 */
+int poison_rate = 1;
 
-static int time_limit = 1;
+/* Guard on average 1 in guard_rate blocks, none if 0 */
+int guard_rate = 0;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Record the call stack of each allocation while set */
+int heap_profile = 0;
+
+/* Modes are set per thread, so that a thread freeing memory in the background
+ * is not affected by the restrictions placed on the main thread.
+ */
+static __thread bool cautious_mode = true;
+static __thread bool noallocate_mode = false;
+static __thread unsigned poison_tick = 0;
+static __thread long guard_countdown = 0;
+static atomic_bool error_occurred = false;
+
+int time_limit = 1;
+
+int perf_counters = 0;
+
+/* Data for managing exceptions, kept per thread so that each thread can guard
+ * risky code of its own
+ */
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread char *error_message = "";
+static __thread bool perf_window = false;
 
 /* Internal functions */
 
+static inline void lock_acquire(pthread_mutex_t *lock)
+{
+    in_allocator++;
+    pthread_mutex_lock(lock);
+}
+
+static inline void lock_release(pthread_mutex_t *lock)
+{
+    pthread_mutex_unlock(lock);
+    if (--in_allocator == 0 && exception_deferred) {
+        exception_deferred = false;
+        trigger_exception(error_message);
+    }
+}
+
+static inline shard_t *shard_of(const void *p)
+{
+    /* Hashing the window keeps the chunks of a shard from sharing low bits,
+     * which would crowd them into a few home slots of its chunk set
+     */
+    uint64_t window = (uintptr_t) p / POOL_CHUNK;
+    return &shards[(window * 0x9e3779b97f4a7c15) >> (64 - SHARD_BITS)];
+}
+
+/* Home slot of address @p in a table of 2^@bits slots */
+static inline size_t home_slot(const void *p, unsigned bits)
+{
+    /* Folding the upper bits into the lower ones keeps blocks allocated
+     * together in neighbouring slots, so runs of frees stay in cache. Folding
+     * in the POOL_CHUNK window too spreads out chunks, whose low bits are 0.
+     */
+    uintptr_t a = (uintptr_t) p >> 4;
+    a ^= a >> 12;
+    return (size_t) (a ^ (a >> bits)) & (((size_t) 1 << bits) - 1);
+}
+
+/* Slot holding @p, or the empty slot where it would go */
+static size_t set_slot(const block_set_t *set, const void *p)
+{
+    size_t mask = ((size_t) 1 << set->bits) - 1;
+    size_t i = home_slot(p, set->bits);
+    while (set->slots[i] && set->slots[i] != p)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/* Whether @p is in @set */
+static inline bool set_has(const block_set_t *set, const void *p)
+{
+    return set->bits && set->slots[set_slot(set, p)];
+}
+
+/* Move @set into a table of 2^@bits slots */
+static bool set_resize(block_set_t *set, unsigned bits)
+{
+    const void **table = calloc((size_t) 1 << bits, sizeof(*table));
+    uint32_t *tags = NULL;
+    if (table && set->tagged)
+        tags = malloc(((size_t) 1 << bits) * sizeof(*tags));
+    if (!table || (set->tagged && !tags)) {
+        free(table);
+        return false;
+    }
+
+    const void **old = set->slots;
+    uint32_t *old_tags = set->tags;
+    size_t old_size = set->bits ? (size_t) 1 << set->bits : 0;
+    set->slots = table;
+    set->tags = tags;
+    set->bits = bits;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i]) {
+            size_t j = set_slot(set, old[i]);
+            table[j] = old[i];
+            if (tags)
+                tags[j] = old_tags[i];
+        }
+    }
+    free(old);
+    free(old_tags);
+    return true;
+}
+
+static bool set_add(block_set_t *set, const void *p)
+{
+    if (!set->bits && !set_resize(set, BLOCK_SET_MIN_BITS))
+        return false;
+    /* A table that cannot grow still works until it is full */
+    size_t size = (size_t) 1 << set->bits;
+    if (2 * (set->count + 1) > size && !set_resize(set, set->bits + 1) &&
+        set->count + 1 == size)
+        return false;
+
+    set->slots[set_slot(set, p)] = p;
+    set->count++;
+    return true;
+}
+
+static bool set_remove(block_set_t *set, const void *p)
+{
+    if (!set->bits)
+        return false;
+
+    size_t mask = ((size_t) 1 << set->bits) - 1;
+    size_t i = set_slot(set, p);
+    if (!set->slots[i])
+        return false;
+    set->slots[i] = NULL;
+    set->count--;
+
+    /* Pull back every later entry of the probe run that may no longer be
+     * reachable from its home slot across the hole
+     */
+    for (size_t j = (i + 1) & mask; set->slots[j]; j = (j + 1) & mask) {
+        size_t home = home_slot(set->slots[j], set->bits);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            set->slots[j] = NULL;
+            if (set->tags)
+                set->tags[i] = set->tags[j];
+            i = j;
+        }
+    }
+
+    if (set->bits > BLOCK_SET_MIN_BITS && 8 * set->count < mask + 1)
+        set_resize(set, set->bits - 1);
+    return true;
+}
+
+/* Tag of @p, which is in tagged @set */
+static inline uint32_t *set_tag(const block_set_t *set, const void *p)
+{
+    return &set->tags[set_slot(set, p)];
+}
+
+/* Size class of a block of @total bytes, POOL_CLASSES if it is not pooled.
+ * AddressSanitizer only sees blocks that go back to libc, so it gets all.
+ */
+static inline size_t pool_class(size_t total)
+{
+#ifdef __SANITIZE_ADDRESS__
+    return POOL_CLASSES;
+#endif
+    return total <= POOL_MAX_BLOCK ? (total - 1) / POOL_ALIGN : POOL_CLASSES;
+}
+
+static inline size_t class_size(size_t cls)
+{
+    return (cls + 1) * POOL_ALIGN;
+}
+
+static inline pool_chunk_t *chunk_of(const block_element_t *b)
+{
+    return (pool_chunk_t *) ((uintptr_t) b & ~(uintptr_t) (POOL_CHUNK - 1));
+}
+
+/* Find the index of block @b in a chunk it may belong to */
+static inline bool chunk_index(const pool_chunk_t *chunk,
+                               const block_element_t *b,
+                               size_t *idx)
+{
+    if ((uintptr_t) b < (uintptr_t) chunk + CHUNK_START)
+        return false;
+
+    /* Offsets are below 2^16 and block sizes below 2^10, so multiplying by
+     * the rounded-up inverse divides exactly, without a division instruction
+     */
+    uint64_t offset = (uintptr_t) b - (uintptr_t) chunk - CHUNK_START;
+    *idx = (size_t) (offset * chunk->inverse >> 32);
+    return *idx * class_size(chunk->cls) == offset;
+}
+
+static inline bool bit_test(const uint64_t *map, size_t idx)
+{
+    return map[idx / 64] >> (idx % 64) & 1;
+}
+
+static inline void bit_set(uint64_t *map, size_t idx)
+{
+    map[idx / 64] |= (uint64_t) 1 << (idx % 64);
+}
+
+static inline void bit_clear(uint64_t *map, size_t idx)
+{
+    map[idx / 64] &= ~((uint64_t) 1 << (idx % 64));
+}
+
+/* Index of pooled block @b in its chunk */
+static inline size_t block_index(const block_element_t *b)
+{
+    size_t idx = 0;
+    chunk_index(chunk_of(b), b, &idx);
+    return idx;
+}
+
+/* Whether block @b is allocated.  Caller holds the lock of @shard */
+static inline bool block_live(shard_t *shard, const block_element_t *b)
+{
+    pool_chunk_t *chunk = chunk_of(b);
+    size_t idx;
+    if (set_has(&shard->chunks, chunk))
+        return chunk_index(chunk, b, &idx) && bit_test(chunk->bitmap, idx);
+    return set_has(&shard->large_blocks, b) ||
+           set_has(&shard->guarded_blocks, b);
+}
+
+/* Take a block of class @cls off the shared free list, or carve a new one.
+ * Caller holds pool_lock
+ */
+static inline block_element_t *pool_take(size_t cls)
+{
+    block_element_t *b = pools[cls].free;
+    if (b) {
+        pools[cls].free = b->next_free;
+        return b;
+    }
+
+    size_t bsize = class_size(cls);
+    if ((size_t) (pools[cls].limit - pools[cls].bump) < bsize) {
+        pool_chunk_t *chunk = aligned_alloc(POOL_CHUNK, POOL_CHUNK);
+        if (!chunk)
+            return NULL;
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->cls = cls;
+        chunk->inverse =
+            (uint32_t) ((((uint64_t) 1 << 32) + bsize - 1) / bsize);
+
+        shard_t *shard = shard_of(chunk);
+        lock_acquire(&shard->lock);
+        bool added = set_add(&shard->chunks, chunk);
+        lock_release(&shard->lock);
+        if (!added) {
+            free(chunk);
+            return NULL;
+        }
+        chunk->next = pools[cls].chunks;
+        pools[cls].chunks = chunk;
+        pools[cls].bump = (unsigned char *) chunk + CHUNK_START;
+        pools[cls].limit = (unsigned char *) chunk + POOL_CHUNK;
+    }
+    b = (block_element_t *) pools[cls].bump;
+    pools[cls].bump += bsize;
+    return b;
+}
+
+/* Put free block @b back on the shared free list.  Caller holds pool_lock */
+static inline void pool_put(block_element_t *b, size_t cls)
+{
+    b->next_free = pools[cls].free;
+    pools[cls].free = b;
+}
+
+/* Hand the blocks cached by the exiting thread back to the pools */
+static void cache_release(void *unused)
+{
+    lock_acquire(&pool_lock);
+    for (size_t cls = 0; cls < POOL_CLASSES; cls++) {
+        block_element_t *b = cache[cls].free;
+        while (b) {
+            block_element_t *next = b->next_free;
+            pool_put(b, cls);
+            b = next;
+        }
+        cache[cls].free = NULL;
+        cache[cls].count = 0;
+    }
+    lock_release(&pool_lock);
+}
+
+static void cache_key_create()
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+/* Fill the empty cache of class @cls with up to CACHE_BATCH blocks, in the
+ * order of the shared free list
+ */
+static bool cache_refill(size_t cls)
+{
+    if (!cache_registered) {
+        pthread_once(&cache_once, cache_key_create);
+        pthread_setspecific(cache_key, cache);
+        cache_registered = true;
+    }
+
+    lock_acquire(&pool_lock);
+    block_element_t **tail = &cache[cls].free;
+    while (cache[cls].count < CACHE_BATCH) {
+        block_element_t *b = pool_take(cls);
+        if (!b)
+            break;
+        *tail = b;
+        tail = &b->next_free;
+        cache[cls].count++;
+    }
+    *tail = NULL;
+    lock_release(&pool_lock);
+    return cache[cls].count > 0;
+}
+
+/* Cache free block @b, handing the older half of a full cache back */
+static void cache_put(block_element_t *b, size_t cls)
+{
+    b->next_free = cache[cls].free;
+    cache[cls].free = b;
+    if (++cache[cls].count < CACHE_BLOCKS)
+        return;
+
+    block_element_t *keep = cache[cls].free;
+    for (unsigned i = 1; i < CACHE_BATCH; i++)
+        keep = keep->next_free;
+    b = keep->next_free;
+    keep->next_free = NULL;
+    cache[cls].count = CACHE_BATCH;
+
+    lock_acquire(&pool_lock);
+    while (b) {
+        block_element_t *next = b->next_free;
+        pool_put(b, cls);
+        b = next;
+    }
+    lock_release(&pool_lock);
+}
+
+/* Record block @b as allocated.  Caller holds the lock of @shard */
+static inline bool block_add(shard_t *shard, block_element_t *b, size_t cls)
+{
+    if (cls == POOL_CLASSES || cls == GUARD_CLASS) {
+        block_set_t *set = cls == GUARD_CLASS ? &shard->guarded_blocks
+                                              : &shard->large_blocks;
+        if (!set_add(set, b))
+            return false;
+    } else {
+        bit_set(chunk_of(b)->bitmap, block_index(b));
+    }
+    shard->allocated_count++;
+    return true;
+}
+
+/* Record block @b as no longer allocated, and find its size class.  Caller
+ * holds the lock of @shard
+ */
+static inline bool block_remove(shard_t *shard, block_element_t *b, size_t *cls)
+{
+    pool_chunk_t *chunk = chunk_of(b);
+    size_t idx;
+    if (set_has(&shard->chunks, chunk)) {
+        if (!chunk_index(chunk, b, &idx) || !bit_test(chunk->bitmap, idx))
+            return false;
+        bit_clear(chunk->bitmap, idx);
+        *cls = chunk->cls;
+    } else if (set_remove(&shard->large_blocks, b)) {
+        *cls = POOL_CLASSES;
+    } else if (set_remove(&shard->guarded_blocks, b)) {
+        *cls = GUARD_CLASS;
+    } else {
+        return false;
+    }
+    shard->allocated_count--;
+    return true;
+}
+
+/* End of the blocks carved so far out of @chunk */
+static unsigned char *chunk_end(pool_chunk_t *chunk)
+{
+    unsigned char *start = (unsigned char *) chunk + CHUNK_START;
+    unsigned char *limit = (unsigned char *) chunk + POOL_CHUNK;
+    size_t bsize = class_size(chunk->cls);
+
+    if (limit == pools[chunk->cls].limit)
+        return pools[chunk->cls].bump;
+    return start + (size_t) (limit - start) / bsize * bsize;
+}
+
+static int chunk_order(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(pool_chunk_t *const *) a;
+    uintptr_t y = (uintptr_t) *(pool_chunk_t *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Release the chunks of class @cls whose blocks are all on the shared free
+ * list, and rebuild the list in address order.  Caller holds pool_lock
+ */
+static void pool_trim(size_t cls)
+{
+    size_t n = 0, bsize = class_size(cls);
+    pool_chunk_t *chunk;
+    for (chunk = pools[cls].chunks; chunk; chunk = chunk->next) {
+        chunk->idle = 0;
+        memset(chunk->pooled, 0, sizeof(chunk->pooled));
+        n++;
+    }
+    for (block_element_t *b = pools[cls].free; b; b = b->next_free) {
+        chunk_of(b)->idle++;
+        bit_set(chunk_of(b)->pooled, block_index(b));
+    }
+
+    pool_chunk_t **sorted = malloc(n * sizeof(*sorted));
+    if (!sorted)
+        return;
+    n = 0;
+    for (chunk = pools[cls].chunks; chunk; chunk = chunk->next)
+        sorted[n++] = chunk;
+    qsort(sorted, n, sizeof(*sorted), chunk_order);
+
+    /* Relinking from the highest address down leaves the list ascending. The
+     * newest chunk is kept for carving.
+     */
+    pools[cls].chunks = NULL;
+    for (size_t i = n; i-- > 0;) {
+        chunk = sorted[i];
+        unsigned char *start = (unsigned char *) chunk + CHUNK_START;
+        if (chunk->idle == (size_t) (chunk_end(chunk) - start) / bsize &&
+            (unsigned char *) chunk + POOL_CHUNK != pools[cls].limit) {
+            shard_t *shard = shard_of(chunk);
+            lock_acquire(&shard->lock);
+            set_remove(&shard->chunks, chunk);
+            lock_release(&shard->lock);
+            free(chunk);
+            continue;
+        }
+        chunk->next = pools[cls].chunks;
+        pools[cls].chunks = chunk;
+    }
+    free(sorted);
+
+    block_element_t **tail = &pools[cls].free;
+    for (chunk = pools[cls].chunks; chunk; chunk = chunk->next) {
+        unsigned char *p = (unsigned char *) chunk + CHUNK_START;
+        unsigned char *end = chunk_end(chunk);
+        for (size_t idx = 0; p < end; p += bsize, idx++) {
+            if (bit_test(chunk->pooled, idx)) {
+                *tail = (block_element_t *) p;
+                tail = &(*tail)->next_free;
+            }
+        }
+    }
+    *tail = NULL;
+}
+
+/* Guarded blocks are placed in a slab reserved up front, made of GUARD_SLOTS
+ * slots of one accessible page followed by an inaccessible one, which bounds
+ * the memory they take. A block ends within POOL_ALIGN bytes of the guard
+ * page of its slot, so that an overflow of its payload runs over the footer
+ * and then faults. A slot is only accessible while its block is allocated,
+ * and freed slots are reused oldest first, so that accesses to a freed block
+ * keep faulting for as long as possible. Blocks larger than a page, and
+ * blocks allocated while every slot is taken, are not guarded.
+ */
+#define GUARD_SLOTS 1024
+#define GUARD_DEPTH 16
+
+/**
+ * guard_slot_t - State of a slot of the guard slab
+ * @block: header of the last block placed in the slot, NULL if none yet
+ * @size: payload size of @block
+ * @live: whether @block is allocated
+ * @depth: number of frames in @frames
+ * @frames: return addresses of the calls that allocated @block, starting
+ *          with test_malloc()
+ *
+ * Slots are read without locking when reporting a fault.
+ */
+typedef struct {
+    const block_element_t *block;
+    size_t size;
+    bool live;
+    unsigned depth;
+    void *frames[GUARD_DEPTH];
+} guard_slot_t;
+
+static unsigned char *guard_slab;
+static size_t guard_page;
+static bool guard_unavailable = false;
+static guard_slot_t guard_slots[GUARD_SLOTS];
+
+/* Free slots in the order they were freed */
+static uint32_t guard_ring[GUARD_SLOTS];
+static size_t guard_head, guard_idle;
+
+/* Guards the slab and its slots */
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reserve the guard slab.  Caller holds guard_lock */
+static bool guard_reserve()
+{
+    if (guard_unavailable)
+        return false;
+    guard_page = (size_t) sysconf(_SC_PAGESIZE);
+    void *slab = mmap(NULL, 2 * GUARD_SLOTS * guard_page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab == MAP_FAILED) {
+        guard_unavailable = true;
+        return false;
+    }
+    for (uint32_t i = 0; i < GUARD_SLOTS; i++)
+        guard_ring[i] = i;
+    guard_idle = GUARD_SLOTS;
+    guard_slab = slab;
+    return true;
+}
+
+/* Place a block of @total bytes in a free slot, recording the calls that
+ * allocated it.  Kept out of line, so that the first frame recorded is
+ * test_malloc().  Return NULL if the block cannot be guarded.
+ */
+static __attribute__((noinline)) block_element_t *guard_alloc(size_t total)
+{
+    block_element_t *b = NULL;
+    lock_acquire(&guard_lock);
+    if ((guard_slab || guard_reserve()) && total <= guard_page && guard_idle) {
+        uint32_t i = guard_ring[guard_head];
+        unsigned char *data = guard_slab + 2 * i * guard_page;
+        if (!mprotect(data, guard_page, PROT_READ | PROT_WRITE)) {
+            guard_head = (guard_head + 1) % GUARD_SLOTS;
+            guard_idle--;
+            b = (block_element_t *) ((uintptr_t) (data + guard_page - total) &
+                                     ~(uintptr_t) (POOL_ALIGN - 1));
+
+            /* Unwinding under the lock also defers timeouts */
+            void *frames[GUARD_DEPTH + 1];
+            int depth = backtrace(frames, GUARD_DEPTH + 1);
+            guard_slot_t *slot = &guard_slots[i];
+            slot->depth = depth > 1 ? (unsigned) depth - 1 : 0;
+            memcpy(slot->frames, frames + 1,
+                   slot->depth * sizeof(*slot->frames));
+            slot->size = total - sizeof(block_element_t) - sizeof(size_t);
+            slot->block = b;
+            slot->live = true;
+        }
+    }
+    lock_release(&guard_lock);
+    return b;
+}
+
+/* Make the slot of guarded block @b inaccessible and queue it for reuse */
+static void guard_free(block_element_t *b)
+{
+    uint32_t i = (uint32_t) (((unsigned char *) b - guard_slab) /
+                             (2 * guard_page));
+    lock_acquire(&guard_lock);
+    mprotect(guard_slab + 2 * i * guard_page, guard_page, PROT_NONE);
+    guard_slots[i].live = false;
+    guard_ring[(guard_head + guard_idle) % GUARD_SLOTS] = i;
+    guard_idle++;
+    lock_release(&guard_lock);
+}
+
+/* Write @s to standard output, which is safe in a signal handler */
+static void write_str(const char *s)
+{
+    size_t len = strlen(s);
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, s, len);
+        if (n <= 0)
+            return;
+        s += n;
+        len -= (size_t) n;
+    }
+}
+
+/* Write @v in @base, with the 0x prefix for hexadecimal */
+static void write_num(uintptr_t v, unsigned base)
+{
+    char buf[2 + 2 * sizeof(v) + 1], *p = buf + sizeof(buf);
+    *--p = '\0';
+    do {
+        *--p = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    if (base == 16) {
+        *--p = 'x';
+        *--p = '0';
+    }
+    write_str(p);
+}
+
+bool guard_report_fault(const void *addr)
+{
+    uintptr_t a = (uintptr_t) addr, base = (uintptr_t) guard_slab;
+    if (!guard_slab || a < base || a - base >= 2 * GUARD_SLOTS * guard_page)
+        return false;
+
+    const guard_slot_t *slot = &guard_slots[(a - base) / (2 * guard_page)];
+    if (!slot->block)
+        return false;
+
+    uintptr_t payload = (uintptr_t) &slot->block->payload;
+    if ((a - base) % (2 * guard_page) >= guard_page)
+        write_str("Overflow of block ");
+    else
+        write_str("Access to freed block ");
+    write_num(payload, 16);
+    write_str(" of ");
+    write_num(slot->size, 10);
+    write_str(" bytes, at offset ");
+    if (a < payload) {
+        write_str("-");
+        write_num(payload - a, 10);
+    } else {
+        write_num(a - payload, 10);
+    }
+    write_str(". Block allocated by:\n");
+
+    /* backtrace_symbols_fd() may load libraries and allocate, neither of
+     * which is safe in a signal handler, so the frames are left raw for
+     * addr2line
+     */
+    for (size_t i = 0; i < slot->depth; i++) {
+        write_str("    [");
+        write_num((uintptr_t) slot->frames[i], 16);
+        write_str("]\n");
+    }
+    return true;
+}
+
+/* Should the next block be guarded?  The gaps between guarded blocks are
+ * drawn at random with a mean of guard_rate, so that no allocation pattern
+ * escapes them, while random() is only called once per guarded block.
+ */
+static bool guard_next()
+{
+    if (guard_rate <= 0)
+        return false;
+    if (--guard_countdown > 0)
+        return false;
+    guard_countdown = 1 + random() % (2 * (long) guard_rate - 1);
+    return true;
+}
+
+/* Should the next block be filled with FILLCHAR? */
+static inline bool poison_next()
+{
+    if (poison_rate <= 1)
+        return poison_rate == 1;
+    if (++poison_tick < (unsigned) poison_rate)
+        return false;
+    poison_tick = 0;
+    return true;
+}
+
+/* Frames kept of the call stack of an allocation, innermost first */
+#define SITE_DEPTH 16
+
+/**
+ * heap_site_t - Allocations made from one call stack
+ * @frames: return addresses, starting with test_malloc()
+ * @depth: number of frames
+ * @bytes: bytes allocated in total
+ * @count: number of allocations
+ * @live: bytes allocated and not yet freed
+ * @peak: highest value of @live
+ */
+typedef struct {
+    void *frames[SITE_DEPTH];
+    unsigned depth;
+    size_t bytes, count, live, peak;
+} heap_site_t;
+
+/* Distinct call stacks, found through a table of their indices plus one,
+ * hashed on the frames. Profiled blocks are tagged with their site.
+ */
+static heap_site_t *sites;
+static uint32_t site_count, site_alloc;
+static uint32_t *site_table;
+static unsigned site_bits;
+static block_set_t profiled_blocks = {.tagged = true};
+
+/* Guards the sites and profiled_blocks, which is never emptied again once a
+ * block has been profiled
+ */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool profile_used = false;
+
+static uint64_t site_hash(void *const *frames, unsigned depth)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (unsigned i = 0; i < depth; i++)
+        h = (h ^ (uintptr_t) frames[i]) * 0x100000001b3;
+    return h ^ (h >> 29);
+}
+
+/* Slot of the site with @frames, or the empty slot where it would go */
+static size_t site_slot(void *const *frames, unsigned depth)
+{
+    size_t mask = ((size_t) 1 << site_bits) - 1;
+    size_t i = (size_t) site_hash(frames, depth) & mask;
+    for (; site_table[i]; i = (i + 1) & mask) {
+        const heap_site_t *site = &sites[site_table[i] - 1];
+        if (site->depth == depth &&
+            !memcmp(site->frames, frames, depth * sizeof(*frames)))
+            break;
+    }
+    return i;
+}
+
+/* Index of the site with @frames, added if new, or UINT32_MAX if out of
+ * memory.  Caller holds profile_lock
+ */
+static uint32_t site_find(void *const *frames, unsigned depth)
+{
+    if (2 * (site_count + 1) > ((size_t) 1 << site_bits)) {
+        unsigned bits = site_bits ? site_bits + 1 : 8;
+        uint32_t *table = calloc((size_t) 1 << bits, sizeof(*table));
+        if (!table)
+            return UINT32_MAX;
+        free(site_table);
+        site_table = table;
+        site_bits = bits;
+        for (uint32_t id = 0; id < site_count; id++)
+            table[site_slot(sites[id].frames, sites[id].depth)] = id + 1;
+    }
+
+    size_t i = site_slot(frames, depth);
+    if (site_table[i])
+        return site_table[i] - 1;
+
+    if (site_count == site_alloc) {
+        uint32_t n = site_alloc ? 2 * site_alloc : 64;
+        heap_site_t *grown = realloc(sites, n * sizeof(*grown));
+        if (!grown)
+            return UINT32_MAX;
+        sites = grown;
+        site_alloc = n;
+    }
+    heap_site_t *site = &sites[site_count];
+    memset(site, 0, sizeof(*site));
+    memcpy(site->frames, frames, depth * sizeof(*frames));
+    site->depth = depth;
+    site_table[i] = ++site_count;
+    return site_count - 1;
+}
+
+/* Charge block @b of @size bytes to the call stack that allocated it.  Kept
+ * out of line, so that the first frame recorded is test_malloc().  Caller
+ * holds profile_lock, which also defers timeouts while unwinding.
+ */
+static __attribute__((noinline)) void profile_alloc(const block_element_t *b,
+                                                    size_t size)
+{
+    void *frames[SITE_DEPTH + 1];
+    int depth = backtrace(frames, SITE_DEPTH + 1);
+    if (depth < 2)
+        return;
+
+    uint32_t id = site_find(frames + 1, (unsigned) depth - 1);
+    if (id == UINT32_MAX || !set_add(&profiled_blocks, b))
+        return;
+    *set_tag(&profiled_blocks, b) = id;
+    profile_used = true;
+
+    heap_site_t *site = &sites[id];
+    site->bytes += size;
+    site->count++;
+    site->live += size;
+    if (site->live > site->peak)
+        site->peak = site->live;
+}
+
+/* Credit the site of block @b with its @size bytes.  Caller holds
+ * profile_lock
+ */
+static void profile_free(const block_element_t *b, size_t size)
+{
+    if (!set_has(&profiled_blocks, b))
+        return;
+    sites[*set_tag(&profiled_blocks, b)].live -= size;
+    set_remove(&profiled_blocks, b);
+}
+
+/* Write the name of the function holding return address @addr, or its
+ * offset in its object file when the symbol is not exported
+ */
+static void write_frame(FILE *f, void *addr)
+{
+    /* The call itself is the byte before the return address */
+    const char *pc = (const char *) addr - 1;
+    Dl_info info;
+    if (!dladdr(pc, &info) || !info.dli_fname) {
+        fprintf(f, "%p", addr);
+    } else if (info.dli_sname) {
+        fputs(info.dli_sname, f);
+    } else {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(f, "%s+%#tx", name ? name + 1 : info.dli_fname,
+                pc - (const char *) info.dli_fbase);
+    }
+}
+
+size_t heap_profile_write(FILE *f, heap_metric_t metric)
+{
+    size_t n = 0;
+    lock_acquire(&profile_lock);
+    for (uint32_t id = 0; id < site_count; id++) {
+        const heap_site_t *site = &sites[id];
+        size_t value = metric == HEAP_COUNT  ? site->count
+                       : metric == HEAP_LIVE ? site->live
+                       : metric == HEAP_PEAK ? site->peak
+                                             : site->bytes;
+        if (!value)
+            continue;
+        /* Folded stacks list the outermost frame first */
+        for (unsigned i = site->depth; i-- > 0;) {
+            write_frame(f, site->frames[i]);
+            fputc(i ? ';' : ' ', f);
+        }
+        fprintf(f, "%zu\n", value);
+        n++;
+    }
+    lock_release(&profile_lock);
+    return n;
+}
+
+void heap_profile_reset()
+{
+    lock_acquire(&profile_lock);
+    for (uint32_t id = 0; id < site_count; id++) {
+        sites[id].bytes = sites[id].count = 0;
+        sites[id].peak = sites[id].live;
+    }
+    lock_release(&profile_lock);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
+    if (!fail_probability)
+        return false;
     double weight = (double) random() / RAND_MAX;
     return (weight < 0.01 * fail_probability);
 }
 
 /* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Signal error if doesn't seem like legitimate block.
+ * Caller holds the lock of the shard of the header
  */
-static block_element_t *find_header(void *p)
+static block_element_t *find_header(shard_t *shard, void *p)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -79,20 +1041,11 @@ static block_element_t *find_header(void *p)
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
+    if (cautious_mode && !block_live(shard, b)) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return NULL;
     }
 
     if (b->magic_header != MAGICHEADER) {
@@ -129,30 +1082,51 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
+    size_t total = size + sizeof(block_element_t) + sizeof(size_t);
+    size_t cls = pool_class(total);
+    block_element_t *new_block = NULL;
+    if (guard_next() && (new_block = guard_alloc(total)))
+        cls = GUARD_CLASS;
+    else if (cls == POOL_CLASSES)
+        new_block = malloc(total);
+    else if (cache[cls].free || cache_refill(cls)) {
+        new_block = cache[cls].free;
+        cache[cls].free = new_block->next_free;
+        cache[cls].count--;
+    }
+
+    bool added = false;
+    if (new_block) {
+        shard_t *shard = shard_of(new_block);
+        lock_acquire(&shard->lock);
+        added = block_add(shard, new_block, cls);
+        if (added) {
+            new_block->magic_header = MAGICHEADER;
+            new_block->payload_size = size;
+            *find_footer(new_block) = MAGICFOOTER;
+        }
+        lock_release(&shard->lock);
+    }
+
+    if (!added) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        if (cls == POOL_CLASSES)
+            free(new_block);
+        else if (new_block && cls == GUARD_CLASS)
+            guard_free(new_block);
+        return NULL;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (heap_profile) {
+        lock_acquire(&profile_lock);
+        profile_alloc(new_block, size);
+        lock_release(&profile_lock);
+    }
 
+    void *p = (void *) &new_block->payload;
+    if (poison_next())
+        memset(p, FILLCHAR, size);
     return p;
 }
 
@@ -178,31 +1152,55 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    shard_t *shard = shard_of((char *) p - sizeof(block_element_t));
+    lock_acquire(&shard->lock);
+    block_element_t *b = find_header(shard, p);
+    size_t cls = POOL_CLASSES, size = 0;
+    if (b) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+
+        /* Blocks not checked up front in cautious mode are caught here,
+         * before they are recycled
+         */
+        if (!block_remove(shard, b, &cls)) {
+            report_event(MSG_ERROR,
+                         "Attempted to free unallocated block.  Address = %p",
+                         p);
+            error_occurred = true;
+            b = NULL;
+        }
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (b) {
+        b->magic_header = MAGICFREE;
+        *find_footer(b) = MAGICFREE;
+        size = b->payload_size;
+    }
+    lock_release(&shard->lock);
+    if (!b)
+        return;
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    /* No other thread can reach the block any more */
+    if (profile_used) {
+        lock_acquire(&profile_lock);
+        profile_free(b, size);
+        lock_release(&profile_lock);
+    }
+    if (cls != GUARD_CLASS && poison_next())
+        memset(p, FILLCHAR, size);
 
-    free(b);
-    allocated_count--;
+    if (cls < POOL_CLASSES)
+        cache_put(b, cls);
+    else if (cls == POOL_CLASSES)
+        free(b);
+    else
+        guard_free(b);
 }
 
 // cppcheck-suppress unusedFunction
@@ -216,15 +1214,39 @@ char *test_strdup(const char *s)
     return memcpy(new, s, len);
 }
 
+/* Return the pooled blocks that are free to the order of their addresses,
+ * so that a run of allocations is carved out of memory in order
+ */
+int test_malloc_trim(size_t pad)
+{
+    cache_release(NULL);
+    lock_acquire(&pool_lock);
+    for (size_t cls = 0; cls < POOL_CLASSES; cls++)
+        pool_trim(cls);
+    lock_release(&pool_lock);
+#ifdef __GLIBC__
+    return malloc_trim(pad);
+#else
+    return 0;
+#endif
+}
+
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    for (size_t i = 0; i < SHARDS; i++) {
+        lock_acquire(&shards[i].lock);
+        count += shards[i].allocated_count;
+        lock_release(&shards[i].lock);
+    }
+    return count;
 }
 
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
- * In this mode, makes extra sure any block to be freed is currently allocated.
+ * In this mode, makes sure any block to be freed is currently allocated
+ * before reading its header.
  */
 void set_cautious_mode(bool cautious)
 {
@@ -242,9 +1264,33 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    /* Commands check after each step, so skip the write when nothing failed */
+    return atomic_load_explicit(&error_occurred, memory_order_relaxed) &&
+           atomic_exchange(&error_occurred, false);
+}
+
+/* Report the hardware counters of the operation that just ended */
+static void perf_window_end()
+{
+    if (!perf_window)
+        return;
+    perf_window = false;
+
+    perf_sample_t s;
+    if (!perf_stop(&s))
+        return;
+
+    char line[256];
+    int len = snprintf(line, sizeof(line), "perf:");
+    for (int i = 0; i < PERF_COUNTERS && len < (int) sizeof(line); i++)
+        if (s.valid[i])
+            len += snprintf(line + len, sizeof(line) - len, " %s %lu",
+                            perf_counter_name(i), (unsigned long) s.count[i]);
+    if (s.valid[PERF_CYCLES] && s.valid[PERF_INSTRUCTIONS] &&
+        s.count[PERF_CYCLES] && len < (int) sizeof(line))
+        snprintf(line + len, sizeof(line) - len, " IPC %.2f",
+                 (double) s.count[PERF_INSTRUCTIONS] / s.count[PERF_CYCLES]);
+    report(1, "%s", line);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -259,6 +1305,7 @@ bool exception_setup(bool limit_time)
             alarm(0);
             time_limited = false;
         }
+        perf_window_end();
 
         if (error_message)
             report_event(MSG_ERROR, error_message);
@@ -275,6 +1322,15 @@ bool exception_setup(bool limit_time)
     return true;
 }
 
+/* Start counting the operation guarded by the current exception setup */
+void perf_window_begin()
+{
+    if (perf_counters && perf_ready() && !perf_window) {
+        perf_window = true;
+        perf_start();
+    }
+}
+
 /* Call once past risky code */
 void exception_cancel()
 {
@@ -282,6 +1338,7 @@ void exception_cancel()
         alarm(0);
         time_limited = false;
     }
+    perf_window_end();
 
     jmp_ready = false;
     error_message = "";
@@ -292,6 +1349,10 @@ void trigger_exception(char *msg)
 {
     error_occurred = true;
     error_message = msg;
+    if (in_allocator) {
+        exception_deferred = true;
+        return;
+    }
     if (jmp_ready)
         siglongjmp(env, 1);
     else
@@ -4,10 +4,12 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
- * allow checking for common allocation errors.
+ * allow checking for common allocation errors.  They may be called from any
+ * number of threads at once.
  */
 
 void *test_malloc(size_t size);
@@ -16,22 +18,99 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+#ifdef QUEUE_FAST
+/* Queue code built against the C library allocator, as in libqueue.a and
+ * qtest-fast, hands out blocks that free() releases
+ */
+#include <stdlib.h>
+#define test_free free
+#endif
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Release the pool chunks whose blocks are all free and put the free blocks
+ * back in address order, then trim the C library heap down to @pad bytes of
+ * slack on glibc.  Blocks cached by other threads stay put.  Return 1 if
+ * the C library gave memory back to the system.
+ */
+int test_malloc_trim(size_t pad);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Fill 1 in N blocks with a byte pattern when they are allocated and when
+ * they are freed, every block if 1 and none if 0.  Header and footer canaries
+ * are checked regardless.
+ */
+extern int poison_rate;
+
+/* Place on average 1 in N blocks right before an inaccessible page, none if
+ * 0.  An overflow past such a block faults at once, and so does an access to
+ * it once freed, until its page is reused.  Only blocks of up to a page are
+ * guarded, and at most 1024 at a time.
+ */
+extern int guard_rate;
+
+/* Describe the guarded block an access to @addr faulted on, with the return
+ * addresses of the calls that allocated it, on standard output.  Only uses
+ * write(2), so it is safe to call from a SIGSEGV handler.  Return false if
+ * @addr is not near any guarded block.
+ */
+bool guard_report_fault(const void *addr);
+
+/* Record the call stack of every allocation while nonzero.  Allocations are
+ * aggregated per distinct stack, and blocks allocated meanwhile are credited
+ * back to their stack when freed, even once recording stops.
+ */
+extern int heap_profile;
+
+/* Value reported for each call stack by heap_profile_write() */
+typedef enum {
+    HEAP_BYTES, /* bytes allocated */
+    HEAP_COUNT, /* number of allocations */
+    HEAP_LIVE,  /* bytes not yet freed */
+    HEAP_PEAK,  /* highest number of bytes not yet freed at once */
+} heap_metric_t;
+
+/* Write one line per recorded call stack to @f, with the frames from the
+ * outermost in, separated by semicolons, then @metric.  This is the folded
+ * format read by flame graph tools.  Return the number of lines written.
+ */
+size_t heap_profile_write(FILE *f, heap_metric_t metric);
+
+/* Clear the counts of the recorded call stacks, starting their peaks over
+ * from the bytes they currently hold
+ */
+void heap_profile_reset();
+
+/* Seconds a single operation may run before it is interrupted, 0 for none */
+extern int time_limit;
+
+/* Report the hardware counters of perf.h over each operation, from
+ * perf_window_begin() to exception_cancel() or the exception, while nonzero.
+ * The counters must have been opened with perf_open().
+ */
+extern int perf_counters;
+
+/* Start counting the operation guarded by the current exception_setup(), if
+ * perf_counters is set.  Commands call it around the queue operation they
+ * measure only, so that the work of helpers that also guard their calls is
+ * not reported.
+ */
+void perf_window_begin();
+
 /*
- * Set/unset cautious mode.
- * In this mode, makes extra sure any block to be freed is currently allocated.
+ * Set/unset cautious mode for the calling thread.
+ * In this mode, makes sure any block to be freed is currently allocated
+ * before reading its header.  The check takes constant time.
  */
 void set_cautious_mode(bool cautious);
 
 /*
- * Set/unset restricted allocation mode.
+ * Set/unset restricted allocation mode for the calling thread.
  * In this mode, calls to malloc and free are disallowed.
  */
 void set_noallocate_mode(bool noallocate);
@@ -41,6 +120,9 @@ bool error_check();
 
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
+ * Each thread has an exception context of its own.  The time limit is
+ * enforced with SIGALRM, which goes to the whole process, so only one thread
+ * at a time should limit time, and other threads should block the signal.
  */
 bool exception_setup(bool limit_time);
 
@@ -51,7 +133,7 @@ void exception_cancel();
  */
 void trigger_exception(char *msg);
 
-#else /* !INTERNAL */
+#elif !defined(QUEUE_FAST)
 
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
@@ -0,0 +1,72 @@
+/* Latency histograms in the style of HdrHistogram */
+
+#include <string.h>
+
+#include "hist.h"
+
+#define SUB_COUNT (1 << HIST_SUB_BITS)
+
+static int bucket_of(uint64_t value)
+{
+    if (value < SUB_COUNT)
+        return (int) value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) +
+           (int) ((value >> shift) & (SUB_COUNT - 1));
+}
+
+/* Largest value that falls in bucket @b */
+static uint64_t bucket_max(int b)
+{
+    if (b < SUB_COUNT)
+        return b;
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (b & (SUB_COUNT - 1)) + 1;
+    return ((SUB_COUNT + sub) << shift) - 1;
+}
+
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(hist_t *h, uint64_t value)
+{
+    if (!h->count || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->total += value;
+    h->buckets[bucket_of(value)]++;
+}
+
+uint64_t hist_quantile(const hist_t *h, double q)
+{
+    if (!h->count)
+        return 0;
+
+    /* Nearest rank: the ceil(q * count)-th smallest value */
+    uint64_t rank = (uint64_t) (q * h->count);
+    if (rank < q * h->count || !rank)
+        rank++;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t value = bucket_max(b);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+uint64_t hist_count_range(const hist_t *h, uint64_t lo, uint64_t hi)
+{
+    if (hi <= lo)
+        return 0;
+    uint64_t n = 0;
+    for (int b = bucket_of(lo); b < HIST_BUCKETS && bucket_max(b) < hi; b++)
+        n += h->buckets[b];
+    return n;
+}
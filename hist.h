@@ -0,0 +1,41 @@
+#ifndef LAB0_HIST_H
+#define LAB0_HIST_H
+
+/* Latency histograms in the style of HdrHistogram
+ *
+ * Values are counted in buckets of logarithmic width: one per value below
+ * 2^HIST_SUB_BITS, then 2^HIST_SUB_BITS per power of two.  Any value of 64
+ * bits is recorded in constant time, and values read back are within
+ * 1/2^HIST_SUB_BITS of those recorded, whatever their magnitude.
+ */
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min, max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/* Forget all values recorded in @h */
+void hist_reset(hist_t *h);
+
+/* Count one occurrence of @value */
+void hist_record(hist_t *h, uint64_t value);
+
+/* Value below or at which a fraction @q of the recorded values lie, rounded
+ * up to the end of its bucket but never above the largest value.  Return 0
+ * when nothing is recorded.
+ */
+uint64_t hist_quantile(const hist_t *h, double q);
+
+/* Number of recorded values from @lo up to, but not including, @hi.  Exact
+ * when both are bucket boundaries, such as powers of two.
+ */
+uint64_t hist_count_range(const hist_t *h, uint64_t lo, uint64_t hi);
+
+#endif /* LAB0_HIST_H */
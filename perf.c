@@ -0,0 +1,124 @@
+/* Hardware performance counters through perf_event_open(2) */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERF_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_CACHE_MISSES] = {"cache-misses", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_DTLB_MISSES] = {"dTLB-load-misses", PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/* The first counter opened leads the group, and the others follow it */
+static int leader = -1;
+static int fds[PERF_COUNTERS];
+static int nr_open = 0;
+
+/* Position of each counter in a group read, -1 when it could not be opened */
+static int slot[PERF_COUNTERS];
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    return (int) syscall(SYS_perf_event_open, attr, 0, -1, group_fd,
+                         PERF_FLAG_FD_CLOEXEC);
+}
+
+int perf_open()
+{
+    if (leader >= 0)
+        return 0;
+
+    int err = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        /* Members count whenever the leader does */
+        attr.disabled = leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int fd = perf_event_open(&attr, leader);
+        if (fd < 0) {
+            err = errno;
+            slot[i] = -1;
+            continue;
+        }
+        if (leader < 0)
+            leader = fd;
+        slot[i] = nr_open;
+        fds[nr_open++] = fd;
+    }
+
+    return leader < 0 ? err : 0;
+}
+
+void perf_close()
+{
+    for (int i = 0; i < nr_open; i++)
+        close(fds[i]);
+    nr_open = 0;
+    leader = -1;
+}
+
+bool perf_ready()
+{
+    return leader >= 0;
+}
+
+void perf_start()
+{
+    if (leader < 0)
+        return;
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+bool perf_stop(perf_sample_t *sample)
+{
+    if (leader < 0)
+        return false;
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    /* nr, time enabled, time running, then one value per counter */
+    uint64_t buf[3 + PERF_COUNTERS];
+    ssize_t len = read(leader, buf, sizeof(buf));
+    if (len < (ssize_t) ((3 + nr_open) * sizeof(uint64_t)) || !buf[2])
+        return false;
+
+    double scale = buf[2] < buf[1] ? (double) buf[1] / buf[2] : 1.0;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        sample->valid[i] = slot[i] >= 0;
+        sample->count[i] =
+            sample->valid[i] ? (uint64_t) (buf[3 + slot[i]] * scale) : 0;
+    }
+    return true;
+}
+
+const char *perf_counter_name(perf_counter_t counter)
+{
+    return events[counter].name;
+}
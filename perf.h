@@ -0,0 +1,54 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+/* Hardware performance counters through perf_event_open(2)
+ *
+ * The counters form a single group, so they are scheduled on the PMU
+ * together and count exactly the same instructions.  They count user-space
+ * events of the thread that opened them only.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_COUNTERS,
+} perf_counter_t;
+
+typedef struct {
+    uint64_t count[PERF_COUNTERS];
+    /* Counters the CPU or kernel does not provide are left out */
+    bool valid[PERF_COUNTERS];
+} perf_sample_t;
+
+/* Open the counters for the calling thread.  Return 0 on success, or the
+ * errno of the failure when not even one of them can be opened, typically
+ * EACCES when kernel.perf_event_paranoid forbids it or ENOENT on machines,
+ * such as most virtual ones, without a PMU.
+ */
+int perf_open();
+
+/* Close the counters, if open */
+void perf_close();
+
+/* Whether perf_open() succeeded and the counters are not closed yet */
+bool perf_ready();
+
+/* Clear the counters and start counting */
+void perf_start();
+
+/* Stop counting and store the counts since perf_start() in @sample.  Counts
+ * are scaled up when the kernel had to multiplex the group with other users
+ * of the PMU.  Return false when the counters could not be read.
+ */
+bool perf_stop(perf_sample_t *sample);
+
+/* Name of @counter, as perf(1) spells it */
+const char *perf_counter_name(perf_counter_t counter);
+
+#endif /* LAB0_PERF_H */
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,8 +21,11 @@
 #include <time.h>
 #endif
 
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
+#include "hist.h"
 #include "list.h"
+#include "perf.h"
 #include "random.h"
 #include "ttt/game.h"
 #include "ttt/ttt.h"
@@ -55,7 +60,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -77,6 +81,44 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Algorithm used by the sort and merge commands, see q_sort_algo_t */
+static int sort_algo = Q_SORT_MERGE;
+
+/* Memory budget of the sort command in KiB, 0 for no limit */
+static int sort_mem = 0;
+
+/* Whether new elements use the single-block layout of q_lean_layout() */
+static int lean = 0;
+
+/* Whether each q_insert_* and q_remove_* call is timed for the hist command */
+static int hist_ops = 0;
+
+/* Cycles taken by the calls timed, one histogram per command */
+typedef enum { HIST_IH, HIST_IT, HIST_RH, HIST_RT, HIST_OPS } hist_op_t;
+static const char *const hist_names[HIST_OPS] = {"ih", "it", "rh", "rt"};
+static hist_t op_hist[HIST_OPS];
+
+/* Whether the free command hands queues to the reclaimer thread */
+static int async_free = 0;
+
+/* Background thread releasing the queues given up by the free command, which
+ * then returns without walking the queue. The thread frees through q_free()
+ * and the harness like the main thread would, so allocation counts stay exact
+ * once it has caught up.
+ */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    struct list_head pending; /* queue contexts waiting to be freed */
+    bool running, busy, stop;
+} reclaimer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .pending = {&reclaimer.pending, &reclaimer.pending},
+};
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -88,312 +130,123 @@ typedef enum {
 /* Forward declarations */
 static bool q_show(int vlevel);
 
-/* For timsort */
-typedef int (*list_cmp_func_t)(void *,
-                               const struct list_head *,
-                               const struct list_head *);
-
-struct pair {
-    struct list_head *head, *next;
-};
-
-static size_t stk_size;
-
-int compare_ascend(void *priv,
-                   const struct list_head *a,
-                   const struct list_head *b)
+static void *reclaim_queues(void *arg)
 {
-    int res = strcmp(list_entry(a, element_t, list)->value,
-                     list_entry(b, element_t, list)->value);
-
-    if (priv)
-        *((int *) priv) += 1;
-
-    return res;
-}
-
-int compare_descend(void *priv,
-                    const struct list_head *a,
-                    const struct list_head *b)
-{
-    int res = strcmp(list_entry(a, element_t, list)->value,
-                     list_entry(b, element_t, list)->value);
-
-    if (priv)
-        *((int *) priv) += 1;
-
-    return -res;
-}
-
-static inline size_t run_size(struct list_head *head)
-{
-    if (!head)
-        return 0;
-    if (!head->next)
-        return 1;
-    return (size_t) (head->next->prev);
-}
+    pthread_mutex_lock(&reclaimer.lock);
+    for (;;) {
+        while (list_empty(&reclaimer.pending) && !reclaimer.stop)
+            pthread_cond_wait(&reclaimer.work, &reclaimer.lock);
+        if (list_empty(&reclaimer.pending))
+            break;
 
-static struct list_head *merge(void *priv,
-                               list_cmp_func_t cmp,
-                               struct list_head *a,
-                               struct list_head *b)
-{
-    struct list_head *head;
-    struct list_head **tail = &head;
+        /* Take every queue handed over so far as one batch */
+        LIST_HEAD(batch);
+        list_splice_init(&reclaimer.pending, &batch);
+        reclaimer.busy = true;
+        pthread_mutex_unlock(&reclaimer.lock);
 
-    for (;;) {
-        /* if equal, take 'a' -- important for sort stability */
-        if (cmp(priv, a, b) <= 0) {
-            *tail = a;
-            tail = &(a->next);
-            a = a->next;
-            if (!a) {
-                *tail = b;
-                break;
-            }
-        } else {
-            *tail = b;
-            tail = &(b->next);
-            b = b->next;
-            if (!b) {
-                *tail = a;
-                break;
-            }
+        queue_contex_t *ctx, *safe;
+        list_for_each_entry_safe (ctx, safe, &batch, chain) {
+            q_free(ctx->q);
+            free(ctx);
         }
-    }
-    return head;
-}
 
-static void build_prev_link(struct list_head *head,
-                            struct list_head *tail,
-                            struct list_head *list)
-{
-    tail->next = list;
-    do {
-        list->prev = tail;
-        tail = list;
-        list = list->next;
-    } while (list);
-
-    /* The final links to make a circular doubly-linked list */
-    tail->next = head;
-    head->prev = tail;
+        pthread_mutex_lock(&reclaimer.lock);
+        reclaimer.busy = false;
+        pthread_cond_broadcast(&reclaimer.idle);
+    }
+    pthread_mutex_unlock(&reclaimer.lock);
+    return NULL;
 }
 
-static void merge_final(void *priv,
-                        list_cmp_func_t cmp,
-                        struct list_head *head,
-                        struct list_head *a,
-                        struct list_head *b)
+static bool reclaimer_start()
 {
-    struct list_head *tail = head;
-
-    for (;;) {
-        /* if equal, take 'a' -- important for sort stability */
-        if (cmp(priv, a, b) <= 0) {
-            tail->next = a;
-            a->prev = tail;
-            tail = a;
-            a = a->next;
-            if (!a)
-                break;
-        } else {
-            tail->next = b;
-            b->prev = tail;
-            tail = b;
-            b = b->next;
-            if (!b) {
-                b = a;
-                break;
-            }
-        }
-    }
+    if (reclaimer.running)
+        return true;
 
-    /* Finish linking remainder of list b on to tail */
-    build_prev_link(head, tail, b);
+    /* Signals such as the time limit alarm must reach the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    reclaimer.stop = false;
+    reclaimer.running =
+        !pthread_create(&reclaimer.thread, NULL, reclaim_queues, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return reclaimer.running;
 }
 
-static struct pair find_run(void *priv,
-                            struct list_head *list,
-                            list_cmp_func_t cmp)
+/* Wait until every queue handed over is freed, then end the thread */
+static void reclaimer_stop()
 {
-    size_t len = 1;
-    struct list_head *next = list->next, *head = list;
-    struct pair result;
-
-    if (!next) {
-        result.head = head, result.next = next;
-        return result;
-    }
+    if (!reclaimer.running)
+        return;
 
-    if (cmp(priv, list, next) > 0) {
-        /* decending run, also reverse the list */
-        struct list_head *prev = NULL;
-        do {
-            len++;
-            list->next = prev;
-            prev = list;
-            list = next;
-            next = list->next;
-            head = list;
-        } while (next && cmp(priv, list, next) > 0);
-        list->next = prev;
-    } else {
-        do {
-            len++;
-            list = next;
-            next = list->next;
-        } while (next && cmp(priv, list, next) <= 0);
-        list->next = NULL;
-    }
-    head->prev = NULL;
-    head->next->prev = (struct list_head *) len;
-    result.head = head, result.next = next;
-    return result;
-}
-
-static struct list_head *merge_at(void *priv,
-                                  list_cmp_func_t cmp,
-                                  struct list_head *at)
-{
-    size_t len = run_size(at) + run_size(at->prev);
-    struct list_head *prev = at->prev->prev;
-    struct list_head *list = merge(priv, cmp, at->prev, at);
-    list->prev = prev;
-    list->next->prev = (struct list_head *) len;
-    --stk_size;
-    return list;
-}
-
-static struct list_head *merge_force_collapse(void *priv,
-                                              list_cmp_func_t cmp,
-                                              struct list_head *tp)
-{
-    while (stk_size >= 3) {
-        if (run_size(tp->prev->prev) < run_size(tp)) {
-            tp->prev = merge_at(priv, cmp, tp->prev);
-        } else {
-            tp = merge_at(priv, cmp, tp);
-        }
-    }
-    return tp;
+    pthread_mutex_lock(&reclaimer.lock);
+    reclaimer.stop = true;
+    pthread_cond_signal(&reclaimer.work);
+    pthread_mutex_unlock(&reclaimer.lock);
+    pthread_join(reclaimer.thread, NULL);
+    reclaimer.running = false;
 }
 
-static struct list_head *merge_collapse(void *priv,
-                                        list_cmp_func_t cmp,
-                                        struct list_head *tp)
+/* Hand a queue to the reclaimer thread, in constant time */
+static void reclaimer_add(queue_contex_t *ctx)
 {
-    int n;
-    while ((n = stk_size) >= 2) {
-        if ((n >= 3 &&
-             run_size(tp->prev->prev) <= run_size(tp->prev) + run_size(tp)) ||
-            (n >= 4 && run_size(tp->prev->prev->prev) <=
-                           run_size(tp->prev->prev) + run_size(tp->prev))) {
-            if (run_size(tp->prev->prev) < run_size(tp)) {
-                tp->prev = merge_at(priv, cmp, tp->prev);
-            } else {
-                tp = merge_at(priv, cmp, tp);
-            }
-        } else if (run_size(tp->prev) <= run_size(tp)) {
-            tp = merge_at(priv, cmp, tp);
-        } else {
-            break;
-        }
-    }
-
-    return tp;
+    pthread_mutex_lock(&reclaimer.lock);
+    list_add_tail(&ctx->chain, &reclaimer.pending);
+    pthread_cond_signal(&reclaimer.work);
+    pthread_mutex_unlock(&reclaimer.lock);
 }
 
-void timsort(void *priv, struct list_head *head, list_cmp_func_t cmp)
+/* Give @ctx and the queues sharing elements with it copies of their own, see
+ * q_dup(). Commands do this before they modify a queue or switch to one, and
+ * before disallowing allocation. The copies are not made to fail.
+ */
+static bool unshare(queue_contex_t *ctx)
 {
-    stk_size = 0;
+    if (!ctx || !ctx->q || !q_shared(ctx->q))
+        return true;
 
-    struct list_head *list = head->next, *tp = NULL;
-    if (head == head->prev)
-        return;
+    bool ok = false;
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    if (exception_setup(true))
+        ok = q_unshare(ctx->q);
+    exception_cancel();
+    fail_probability = saved_probability;
 
-    /* Convert to a null-terminated singly-linked list. */
-    head->prev->next = NULL;
-
-    do {
-        /* Find next run */
-        struct pair result = find_run(priv, list, cmp);
-        result.head->prev = tp;
-        tp = result.head;
-        list = result.next;
-        stk_size++;
-        tp = merge_collapse(priv, cmp, tp);
-    } while (list);
-
-    /* End of input; merge together all the runs. */
-    tp = merge_force_collapse(priv, cmp, tp);
-
-    /* The final merge; rebuild prev links */
-    struct list_head *stk0 = tp, *stk1 = stk0->prev;
-    while (stk1 && stk1->prev)
-        stk0 = stk0->prev, stk1 = stk1->prev;
-    if (stk_size <= 1) {
-        build_prev_link(head, head, stk0);
-        return;
-    }
-    merge_final(priv, cmp, head, stk1, stk0);
+    if (!ok)
+        report(1, "ERROR: Could not copy the elements of a snapshot");
+    return ok;
 }
 
-bool do_timsort(int argc, char *argv[])
+/* Turn a compressed queue back into elements, see q_compress(). Commands do
+ * this before they modify it or merge it with other queues, while size, dup
+ * and save work on the compressed form. As with unshare(), the new elements
+ * are not made to fail.
+ */
+static bool expand(queue_contex_t *ctx)
 {
-    int count;
-
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
-        return false;
-    }
-
-    int cnt = 0;
-    if (!current || !current->q)
-        report(3, "Warning: Calling sort on null queue");
-    else
-        cnt = q_size(current->q);
-    error_check();
-
-    if (cnt < 2)
-        report(3, "Warning: Calling sort on single node");
-    error_check();
+    if (!ctx || !ctx->q || !q_compressed(ctx->q))
+        return true;
 
-    set_noallocate_mode(true);
-    if (current && exception_setup(true)) {
-        if (descend)
-            timsort(&count, current->q, compare_descend);
-        else
-            timsort(&count, current->q, compare_ascend);
-    }
+    bool ok = false;
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    if (exception_setup(true))
+        ok = q_decompress(ctx->q);
     exception_cancel();
-    set_noallocate_mode(false);
+    fail_probability = saved_probability;
 
-    bool ok = true;
-    if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
-            }
-
-            if (descend && strcmp(item->value, next_item->value) < 0) {
-                report(1, "ERROR: Not sorted in descending order");
-                ok = false;
-                break;
-            }
-        }
-    }
+    if (!ok)
+        report(1, "ERROR: Could not decompress queue %d", ctx->id);
+    return ok;
+}
 
-    q_show(3);
-    return ok && !error_check();
+/* Prepare @ctx to be modified */
+static bool writable(queue_contex_t *ctx)
+{
+    return unshare(ctx) && expand(ctx);
 }
 
 static bool do_free(int argc, char *argv[])
@@ -411,9 +264,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -423,22 +273,32 @@ static bool do_free(int argc, char *argv[])
     if (current) {
         list_del(&current->chain);
 
-        if (exception_setup(true))
-            q_free(current->q);
-        exception_cancel();
-        set_cautious_mode(true);
+        /* Freeing a shared queue hands its elements over in constant time,
+         * and must not race with the queues receiving them
+         */
+        if (reclaimer.running && !q_shared(current->q)) {
+            reclaimer_add(current);
+        } else {
+            if (exception_setup(true)) {
+                perf_window_begin();
+                q_free(current->q);
+            }
+            exception_cancel();
+            free(current);
+        }
     }
 
     if (current) {
-        free(current);
         chain.size--;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
     }
 
+    ok = unshare(current);
     q_show(3);
 
+    /* Queues being freed in the background are checked for leaks on quit */
     size_t bcnt = allocation_check();
-    if (!chain.size && bcnt > 0) {
+    if (!chain.size && !reclaimer.running && bcnt > 0) {
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
                bcnt);
@@ -458,6 +318,7 @@ static bool do_new(int argc, char *argv[])
     bool ok = true;
 
     if (exception_setup(true)) {
+        perf_window_begin();
         queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
         list_add_tail(&qctx->chain, &chain.head);
 
@@ -473,6 +334,47 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static bool do_dup(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling dup on null queue");
+        return false;
+    }
+    error_check();
+
+    struct list_head *q = NULL;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        q = q_dup(current->q);
+    }
+    exception_cancel();
+    if (!q) {
+        report(1, "ERROR: Could not create snapshot");
+        return false;
+    }
+
+    queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+    if (!qctx) {
+        q_free(q);
+        report(1, "ERROR: Could not create snapshot");
+        return false;
+    }
+    list_add_tail(&qctx->chain, &chain.head);
+    qctx->q = q;
+    qctx->size = current->size;
+    qctx->id = chain.size++;
+    report(3, "Queue %d is a %s of queue %d", qctx->id,
+           q_compressed(q) ? "compressed copy" : "snapshot", current->id);
+
+    q_show(3);
+    return !error_check();
+}
+
 /* TODO: Add a buf_size check of if the buf_size may be less
  * than MIN_RANDSTR_LEN.
  */
@@ -488,6 +390,57 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Insert the lines of the file at @path */
+static bool queue_insert_file(position_t pos, const char *path)
+{
+    if (!current || !current->q) {
+        report(3, "Warning: Calling insert %s on null queue",
+               pos == POS_TAIL ? "tail" : "head");
+        return false;
+    }
+    error_check();
+
+    if (!writable(current))
+        return false;
+
+    struct timespec start, end;
+    size_t cnt = 0;
+    bool ok = false;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_insert_file(current->q, path, pos == POS_TAIL, &cnt);
+    }
+    exception_cancel();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    current->size += cnt;
+
+    struct stat st;
+    bool readable = !stat(path, &st);
+    if (!ok && (!readable || fail_probability == 0)) {
+        report(1, "ERROR: Could not insert the lines of '%s'", path);
+        return false;
+    }
+    if (!ok) {
+        /* Allocation may have been made to fail */
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1, "ERROR: Insertion failed (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        report(2, "Insertion failed after %zu lines", cnt);
+    } else {
+        double sec = (end.tv_sec - start.tv_sec) +
+                     1e-9 * (end.tv_nsec - start.tv_nsec);
+        report(2, "Inserted %zu lines (%.1f MB/s)", cnt,
+               sec > 0 ? st.st_size / sec / 1e6 : 0);
+    }
+
+    q_show(3);
+    return !error_check();
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -509,7 +462,7 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     char *lasts = NULL;
     char randstr_buf[MAX_RANDSTR_LEN];
-    int reps = 1;
+    long reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
         report(1, "%s needs 1-2 arguments", argv[0]);
@@ -517,8 +470,10 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     }
 
     char *inserts = argv[1];
+    if (argc == 3 && !strcmp(inserts, "FILE"))
+        return queue_insert_file(pos, argv[2]);
     if (argc == 3) {
-        if (!get_int(argv[2], &reps)) {
+        if (!get_long(argv[2], &reps)) {
             report(1, "Invalid number of insertions '%s'", argv[2]);
             return false;
         }
@@ -534,12 +489,20 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    if (!writable(current))
+        return false;
+
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
+        perf_window_begin();
+        for (long r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
+            int64_t start = hist_ops ? cpucycles() : 0;
             bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
                                         : q_insert_head(current->q, inserts);
+            if (hist_ops)
+                hist_record(&op_hist[pos == POS_TAIL ? HIST_IT : HIST_IH],
+                            cpucycles() - start);
             if (rval) {
                 current->size++;
                 element_t *entry =
@@ -656,11 +619,20 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
                pos == POS_TAIL ? "tail" : "head");
     error_check();
 
+    if (!writable(current))
+        return false;
+
     element_t *re = NULL;
-    if (current && exception_setup(true))
+    if (current && exception_setup(true)) {
+        perf_window_begin();
+        int64_t start = hist_ops ? cpucycles() : 0;
         re = pos == POS_TAIL
                  ? q_remove_tail(current->q, removes, string_length + 1)
                  : q_remove_head(current->q, removes, string_length + 1);
+        if (hist_ops)
+            hist_record(&op_hist[pos == POS_TAIL ? HIST_RT : HIST_RH],
+                        cpucycles() - start);
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
@@ -737,6 +709,9 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    if (!writable(current))
+        return false;
+
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
 
@@ -748,6 +723,7 @@ static bool do_dedup(int argc, char *argv[])
             if (!tmp)
                 break;
             INIT_LIST_HEAD(&tmp->list);
+            tmp->lean = false;
             slen = strlen(item->value) + 1;
             tmp->value = malloc(slen);
             if (!tmp->value) {
@@ -771,8 +747,10 @@ static bool do_dedup(int argc, char *argv[])
     }
 
     bool ok = true;
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         ok = q_delete_dup(current->q);
+    }
     exception_cancel();
 
     if (!ok) {
@@ -804,139 +782,744 @@ static bool do_dedup(int argc, char *argv[])
             ok = false;
         is_this_dup = is_next_dup;
     }
-    // All elements in new list should be traversed
-    ok = ok && l_tmp == current->q;
-    if (!ok)
-        report(1,
-               "ERROR: Duplicate strings are in queue or distinct strings are "
-               "not in queue");
+    // All elements in new list should be traversed
+    ok = ok && l_tmp == current->q;
+    if (!ok)
+        report(1,
+               "ERROR: Duplicate strings are in queue or distinct strings are "
+               "not in queue");
+
+    list_for_each_entry_safe (item, tmp, &l_copy, list) {
+        free(item->value);
+        free(item);
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_reverse(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q)
+        report(3, "Warning: Calling reverse on null queue");
+    error_check();
+
+    if (!writable(current))
+        return false;
+
+    set_noallocate_mode(true);
+    if (current && exception_setup(true)) {
+        perf_window_begin();
+        q_reverse(current->q);
+    }
+    exception_cancel();
+
+    set_noallocate_mode(false);
+    q_show(3);
+    return !error_check();
+}
+
+static bool do_size(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    long reps = 1;
+    bool ok = true;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 2) {
+        if (!get_long(argv[1], &reps))
+            report(1, "Invalid number of calls to size '%s'", argv[2]);
+    }
+
+    size_t cnt = 0;
+    if (!current || !current->q)
+        report(3, "Warning: Calling size on null queue");
+    error_check();
+
+    /* A compressed queue is counted as it is, without expanding it */
+    bool packed = current && q_compressed(current->q);
+    if (current && exception_setup(true)) {
+        perf_window_begin();
+        for (long r = 0; ok && r < reps; r++) {
+            cnt = packed ? qc_size(current->q) : q_size(current->q);
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    if (current && ok) {
+        if (current->size == cnt) {
+            report(2, "Queue size = %zu", cnt);
+        } else {
+            report(1,
+                   "ERROR: Computed queue size as %zu, but correct value is "
+                   "%zu",
+                   cnt, current->size);
+            ok = false;
+        }
+    }
+
+    q_show(3);
+
+    return ok && !error_check();
+}
+
+/* Sorting is checked under no-allocate mode, unless a memory budget lets it
+ * spill to temporary files, which frees and reallocates every element.
+ * Failures injected into those allocations must not lose any element.
+ */
+static void sort_mode(bool enter)
+{
+    if (!sort_mem)
+        set_noallocate_mode(enter);
+}
+
+/* Sort with the given algorithm, then check the order and report the number
+ * of comparisons made
+ */
+static bool queue_sort(q_sort_algo_t algo, int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    size_t cnt = 0;
+    if (!current || !current->q)
+        report(3, "Warning: Calling sort on null queue");
+    error_check();
+
+    if (!writable(current))
+        return false;
+    if (current && current->q)
+        cnt = q_size(current->q);
+
+    if (cnt < 2)
+        report(3, "Warning: Calling sort on single node");
+    error_check();
+
+    q_sort_select(algo, true);
+    sort_mode(true);
+    if (current && exception_setup(true)) {
+        perf_window_begin();
+        q_sort(current->q, descend);
+    }
+    exception_cancel();
+    sort_mode(false);
+    q_sort_select(sort_algo, true);
+
+    bool ok = true;
+    if (current && current->q && q_size(current->q) != cnt) {
+        report(1, "ERROR: Queue has %zu elements instead of %zu",
+               q_size(current->q), cnt);
+        ok = false;
+    }
+    if (ok && current && current->size) {
+        report(2, "Comparisons = %zu", q_sort_comparisons());
+        for (struct list_head *cur_l = current->q->next;
+             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+            /* Ensure each element in ascending/descending order */
+            element_t *item, *next_item;
+            item = list_entry(cur_l, element_t, list);
+            next_item = list_entry(cur_l->next, element_t, list);
+            if (!descend && strcmp(item->value, next_item->value) > 0) {
+                report(1, "ERROR: Not sorted in ascending order");
+                ok = false;
+                break;
+            }
+
+            if (descend && strcmp(item->value, next_item->value) < 0) {
+                report(1, "ERROR: Not sorted in descending order");
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_sort(int argc, char *argv[])
+{
+    return queue_sort(sort_algo, argc, argv);
+}
+
+static bool do_timsort(int argc, char *argv[])
+{
+    return queue_sort(Q_SORT_TIMSORT, argc, argv);
+}
+
+static bool do_topk(int argc, char *argv[])
+{
+    long k = 0;
+
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_long(argv[1], &k) || k <= 0) {
+        report(1, "Invalid number of k '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling topk on null queue");
+        return false;
+    }
+    error_check();
+
+    if (!writable(current))
+        return false;
+
+    bool ok = true, selected = false;
+    size_t cnt = q_size(current->q);
+    if (exception_setup(true)) {
+        perf_window_begin();
+        selected = q_sort_topk(current->q, k, descend);
+    }
+    exception_cancel();
+
+    if (!selected) {
+        /* Allocation may have been made to fail, leaving the queue as it was */
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1,
+                   "ERROR: Could not sort the first %ld elements (%d failures "
+                   "total)",
+                   k, fail_count);
+            return false;
+        }
+        report(2, "Selection of the first %ld elements failed", k);
+    } else {
+        report(2, "Comparisons = %zu", q_sort_comparisons());
+    }
+
+    if (q_size(current->q) != cnt) {
+        report(1, "ERROR: Queue has %zu elements instead of %zu",
+               q_size(current->q), cnt);
+        ok = false;
+    }
+
+    /* The first k elements must be in order, and none of the others may go
+     * before the last of them
+     */
+    struct list_head *cur_l, *last = NULL;
+    long i = 0;
+    list_for_each (cur_l, current->q) {
+        if (!ok || !selected)
+            break;
+        if (last) {
+            int cmp = strcmp(list_entry(last, element_t, list)->value,
+                             list_entry(cur_l, element_t, list)->value);
+            if (descend ? cmp < 0 : cmp > 0) {
+                report(1, "ERROR: %s element in wrong position",
+                       i < k ? "Selected" : "Unselected");
+                ok = false;
+            }
+        }
+        if (i++ < k)
+            last = cur_l;
+    }
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_mergeview(int argc, char *argv[])
+{
+    long n = LONG_MAX;
+
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_long(argv[1], &n) || n < 0)) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling mergeview on null queue");
+        return false;
+    }
+    error_check();
+
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        if (!expand(ctx))
+            return false;
+    }
+
+    qm_cursor_t *cur = NULL;
+    if (exception_setup(true))
+        cur = qm_cursor_open(&chain.head, descend);
+    exception_cancel();
+    if (!cur) {
+        report(1, "ERROR: Could not open merge cursor");
+        return false;
+    }
+
+    /* Scanning must neither allocate nor relink anything */
+    bool ok = true;
+    size_t cnt = 0;
+    element_t *prev = NULL;
+    report_noreturn(3, "m = [");
+    set_noallocate_mode(true);
+    if (exception_setup(true)) {
+        perf_window_begin();
+        element_t *e;
+        while (ok && cnt < (size_t) n && (e = qm_cursor_next(cur))) {
+            if (cnt < BIG_LIST_SIZE)
+                report_noreturn(3, cnt == 0 ? "%s" : " %s", e->value);
+            if (prev) {
+                int cmp = strcmp(prev->value, e->value);
+                if (descend ? cmp < 0 : cmp > 0) {
+                    report(3, " ... ]");
+                    report(1, "ERROR: Not merged in %s order",
+                           descend ? "descending" : "ascending");
+                    ok = false;
+                }
+            }
+            prev = e;
+            cnt++;
+        }
+    }
+    exception_cancel();
+    set_noallocate_mode(false);
+    qm_cursor_close(cur);
+
+    if (!ok)
+        return false;
+    report(3, cnt <= BIG_LIST_SIZE ? "]" : " ... ]");
+
+    size_t total = 0;
+    list_for_each_entry (ctx, &chain.head, chain)
+        total += ctx->size;
+    if ((size_t) n < total)
+        total = n;
+    if (cnt != total) {
+        report(1, "ERROR: Merged %zu elements, expected %zu", cnt, total);
+        ok = false;
+    }
+    report(2, "Comparisons = %zu", q_sort_comparisons());
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+/* Time a walk over the queue that reads every string, in ns per element */
+static double traverse_ns(struct list_head *head, size_t n)
+{
+    double best = 0;
+    unsigned sum = 0;
+
+    for (int r = 0; r < 3; r++) {
+        struct timespec start, end;
+        element_t *e;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        list_for_each_entry (e, head, list)
+            sum += (unsigned char) e->value[0];
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                    (end.tv_nsec - start.tv_nsec);
+        if (r == 0 || ns < best)
+            best = ns;
+    }
+    /* Keep the reads from being optimized away */
+    __asm__ volatile("" : : "r"(sum));
+    return n ? best / n : 0;
+}
+
+static bool do_compact(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling compact on null queue");
+        return false;
+    }
+    error_check();
+
+    if (!writable(current))
+        return false;
+
+    double before = traverse_ns(current->q, current->size);
+    bool ok = false;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_compact(current->q);
+    }
+    exception_cancel();
+
+    if (!ok) {
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1, "ERROR: Compaction failed (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        report(2, "Compaction failed");
+    } else if (q_size(current->q) != current->size) {
+        report(1, "ERROR: Queue has %zu elements instead of %zu",
+               q_size(current->q), current->size);
+        return false;
+    } else {
+        report(2, "Traversal: %.2f ns/node before, %.2f ns/node after",
+               before, traverse_ns(current->q, current->size));
+    }
+
+    q_show(3);
+    return !error_check();
+}
+
+static bool do_trim(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    /* Fresh blocks come out in address order afterwards, so that q_compact()
+     * lays elements out contiguously
+     */
+    if (test_malloc_trim(0))
+        report(2, "Memory returned to the system");
+    return !error_check();
+}
+
+/* Time decoding every string of a compressed queue, in ns per string */
+static double decode_ns(struct list_head *head, size_t n)
+{
+    double best = 0;
+    unsigned sum = 0;
+
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    for (int r = 0; r < 3; r++) {
+        struct timespec start, end;
+        const char *str;
+        qc_cursor_t *cur = qc_cursor_open(head);
+        if (!cur)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while ((str = qc_cursor_next(cur)))
+            sum += (unsigned char) str[0];
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        qc_cursor_close(cur);
+        double ns = (end.tv_sec - start.tv_sec) * 1e9 +
+                    (end.tv_nsec - start.tv_nsec);
+        if (r == 0 || ns < best)
+            best = ns;
+    }
+    fail_probability = saved_probability;
+    __asm__ volatile("" : : "r"(sum));
+    return n ? best / n : 0;
+}
+
+static bool do_compress(int argc, char *argv[])
+{
+    long block = 0;
+
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 2 && (!get_long(argv[1], &block) || block <= 0)) {
+        report(1, "Invalid block size '%s'", argv[1]);
+        return false;
+    }
 
-    list_for_each_entry_safe (item, tmp, &l_copy, list) {
-        free(item->value);
-        free(item);
+    if (!current || !current->q) {
+        report(3, "Warning: Calling compress on null queue");
+        return false;
+    }
+    error_check();
+
+    if (!unshare(current))
+        return false;
+    if (q_compressed(current->q)) {
+        report(3, "Warning: Queue is already compressed");
+        return true;
+    }
+
+    size_t before = q_footprint(current->q);
+    double plain = traverse_ns(current->q, current->size);
+    bool ok = false;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_compress(current->q, block);
+    }
+    exception_cancel();
+
+    if (!ok) {
+        /* Without injected failures, only an unsorted queue is refused */
+        if (!fail_probability) {
+            report(1, "ERROR: Could not compress queue, it must be sorted");
+            return false;
+        }
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1, "ERROR: Compression failed (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        report(2, "Compression failed");
+    } else {
+        size_t after = q_footprint(current->q);
+        report(2, "Memory: %zu bytes plain, %zu bytes compressed (%.1f%%)",
+               before, after, before ? 100.0 * after / before : 0);
+        report(2, "Traversal: %.2f ns/node plain, %.2f ns/string decoded",
+               plain, decode_ns(current->q, current->size));
     }
 
     q_show(3);
-    return ok && !error_check();
+    return !error_check();
 }
 
-static bool do_reverse(int argc, char *argv[])
+static bool do_decompress(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!current || !current->q)
-        report(3, "Warning: Calling reverse on null queue");
+    if (!current || !current->q) {
+        report(3, "Warning: Calling decompress on null queue");
+        return false;
+    }
     error_check();
 
-    set_noallocate_mode(true);
-    if (current && exception_setup(true))
-        q_reverse(current->q);
+    if (!q_compressed(current->q)) {
+        report(3, "Warning: Queue is not compressed");
+        return true;
+    }
+
+    bool ok = false;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_decompress(current->q);
+    }
     exception_cancel();
 
-    set_noallocate_mode(false);
+    if (!ok) {
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1, "ERROR: Decompression failed (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        report(2, "Decompression failed");
+    } else if (q_size(current->q) != current->size) {
+        report(1, "ERROR: Queue has %zu elements instead of %zu",
+               q_size(current->q), current->size);
+        return false;
+    }
+
     q_show(3);
     return !error_check();
 }
 
-static bool do_size(int argc, char *argv[])
+static bool do_save(int argc, char *argv[])
 {
-    if (argc != 1 && argc != 2) {
-        report(1, "%s takes 0-1 arguments", argv[0]);
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
         return false;
     }
 
-    int reps = 1;
-    bool ok = true;
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (!current || !current->q) {
+        report(3, "Warning: Calling save on null queue");
         return false;
     }
+    error_check();
 
-    if (argc == 2) {
-        if (!get_int(argv[1], &reps))
-            report(1, "Invalid number of calls to size '%s'", argv[2]);
+    bool ok = false;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_save(current->q, argv[1]);
+    }
+    exception_cancel();
+
+    if (!ok) {
+        report(1, "ERROR: Could not save queue to '%s'", argv[1]);
+        return false;
     }
+    report(2, "Saved %zu elements to '%s'", current->size, argv[1]);
+    return !error_check();
+}
 
-    int cnt = 0;
-    if (!current || !current->q)
-        report(3, "Warning: Calling size on null queue");
+static bool do_load(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling load on null queue");
+        return false;
+    }
     error_check();
 
-    if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            cnt = q_size(current->q);
-            ok = ok && !error_check();
-        }
+    if (!writable(current))
+        return false;
+
+    bool ok = false;
+    if (exception_setup(true)) {
+        perf_window_begin();
+        ok = q_load(current->q, argv[1]);
     }
     exception_cancel();
 
-    if (current && ok) {
-        if (current->size == cnt) {
-            report(2, "Queue size = %d", cnt);
-        } else {
-            report(1,
-                   "ERROR: Computed queue size as %d, but correct value is %d",
-                   cnt, (int) current->size);
-            ok = false;
+    if (ok) {
+        size_t size = q_size(current->q);
+        report(2, "Loaded %zu elements from '%s'", size - current->size,
+               argv[1]);
+        current->size = size;
+    } else if (access(argv[1], R_OK) || fail_probability == 0) {
+        report(1, "ERROR: Could not load queue from '%s'", argv[1]);
+        return false;
+    } else {
+        /* Allocation may have been made to fail */
+        fail_count++;
+        if (fail_count >= fail_limit) {
+            report(1, "ERROR: Loading failed (%d failures total)", fail_count);
+            return false;
         }
+        report(2, "Loading failed");
     }
 
     q_show(3);
+    return !error_check();
+}
 
-    return ok && !error_check();
+/* Width of the longest bar of a hist distribution */
+#define HIST_BAR 50
+
+static void hist_show(hist_op_t op)
+{
+    static const char bar[HIST_BAR + 1] =
+        "##################################################";
+    const hist_t *h = &op_hist[op];
+
+    report(1, "%s: %lu calls, mean %.1f cycles", hist_names[op],
+           (unsigned long) h->count, (double) h->total / h->count);
+    report(1, "  min %lu  p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  p99.99 %lu  "
+              "max %lu",
+           (unsigned long) h->min, (unsigned long) hist_quantile(h, 0.5),
+           (unsigned long) hist_quantile(h, 0.9),
+           (unsigned long) hist_quantile(h, 0.99),
+           (unsigned long) hist_quantile(h, 0.999),
+           (unsigned long) hist_quantile(h, 0.9999), (unsigned long) h->max);
+
+    /* One row per power of two from the fastest call to the slowest */
+    int first = 63 - __builtin_clzll(h->min | 1);
+    int last = 63 - __builtin_clzll(h->max | 1);
+    uint64_t rows[64], peak = 0;
+    for (int k = first; k <= last; k++) {
+        uint64_t lo = k ? 1ULL << k : 0;
+        uint64_t hi = k < 63 ? 2ULL << k : UINT64_MAX;
+        rows[k] = hist_count_range(h, lo, hi);
+        if (rows[k] > peak)
+            peak = rows[k];
+    }
+    for (int k = first; k <= last; k++) {
+        int width = (int) (rows[k] * HIST_BAR / peak);
+        if (rows[k] && !width)
+            width = 1;
+        report(1, "  %12lu .. %-12lu %10lu %.*s",
+               (unsigned long) (k ? 1ULL << k : 0),
+               (unsigned long) ((2ULL << k) - 1), (unsigned long) rows[k],
+               width, bar);
+    }
 }
 
-bool do_sort(int argc, char *argv[])
+static bool do_hist(int argc, char *argv[])
 {
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (int op = 0; op < HIST_OPS; op++)
+            hist_reset(&op_hist[op]);
+        return true;
+    }
     if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+        report(1, "Usage: %s [reset]", argv[0]);
         return false;
     }
 
-    int cnt = 0;
-    if (!current || !current->q)
-        report(3, "Warning: Calling sort on null queue");
-    else
-        cnt = q_size(current->q);
-    error_check();
-
-    if (cnt < 2)
-        report(3, "Warning: Calling sort on single node");
-    error_check();
-
-    set_noallocate_mode(true);
-    if (current && exception_setup(true))
-        q_sort(current->q, descend);
-    exception_cancel();
-    set_noallocate_mode(false);
+    bool any = false;
+    for (int op = 0; op < HIST_OPS; op++) {
+        if (op_hist[op].count) {
+            hist_show(op);
+            any = true;
+        }
+    }
+    if (!any)
+        report(1, "No operations recorded%s",
+               hist_ops ? "" : ". Use 'option hist 1' first");
+    return true;
+}
 
-    bool ok = true;
-    if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
-            }
+static bool do_heapprof(int argc, char *argv[])
+{
+    static const char *const metrics[] = {
+        [HEAP_BYTES] = "bytes",
+        [HEAP_COUNT] = "count",
+        [HEAP_LIVE] = "live",
+        [HEAP_PEAK] = "peak",
+    };
+
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        heap_profile_reset();
+        return true;
+    }
+    if (argc > 3) {
+        report(1, "%s takes at most 2 arguments", argv[0]);
+        return false;
+    }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
-                report(1, "ERROR: Not sorted in descending order");
-                ok = false;
-                break;
-            }
+    heap_metric_t metric = HEAP_BYTES;
+    if (argc > 1) {
+        size_t i = 0;
+        while (i < ARRAY_SIZE(metrics) && strcmp(argv[1], metrics[i]))
+            i++;
+        if (i == ARRAY_SIZE(metrics)) {
+            report(1, "ERROR: Unknown metric '%s'", argv[1]);
+            return false;
         }
+        metric = (heap_metric_t) i;
     }
 
-    q_show(3);
-    return ok && !error_check();
+    FILE *f = stdout;
+    if (argc == 3 && !(f = fopen(argv[2], "w"))) {
+        report(1, "ERROR: Could not open '%s'", argv[2]);
+        return false;
+    }
+    size_t n = heap_profile_write(f, metric);
+    if (f != stdout && fclose(f)) {
+        report(1, "ERROR: Could not write '%s'", argv[2]);
+        return false;
+    }
+    fflush(stdout);
+    if (!n && !heap_profile)
+        report(1, "No allocations recorded. Use 'option heapprof 1' first");
+    else if (f != stdout)
+        report(2, "Wrote %zu call stacks to '%s'", n, argv[2]);
+    return true;
 }
 
 static bool do_dm(int argc, char *argv[])
@@ -952,9 +1535,14 @@ static bool do_dm(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
     bool ok = true;
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         ok = q_delete_mid(current->q);
+    }
     exception_cancel();
 
     if (!current->size)
@@ -978,9 +1566,14 @@ static bool do_swap(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
     set_noallocate_mode(true);
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         q_swap(current->q);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -1019,6 +1612,8 @@ void q_shuffle(struct list_head *head)
     if (n == 1)
         return;
 
+    q_mark_unsorted(head);
+
     for (int i = 0; i < n; i++) {
         int j = (rand() % (n - i)) + 1;
         struct list_head *target = find_node(head, j);
@@ -1039,9 +1634,14 @@ static bool do_shuffle(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
     set_noallocate_mode(true);
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         q_shuffle(current->q);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -1122,16 +1722,21 @@ static bool do_ascend(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
 
-    int cnt = q_size(current->q);
+    size_t cnt = q_size(current->q);
     if (!cnt)
         report(3, "Warning: Calling ascend on empty queue");
     else if (cnt < 2)
         report(3, "Warning: Calling ascend on single node");
     error_check();
 
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         current->size = q_ascend(current->q);
+    }
     set_noallocate_mode(false);
 
     bool ok = true;
@@ -1169,16 +1774,21 @@ static bool do_descend(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
 
-    int cnt = q_size(current->q);
+    size_t cnt = q_size(current->q);
     if (!cnt)
         report(3, "Warning: Calling descend on empty queue");
     else if (cnt < 2)
         report(3, "Warning: Calling descend on single node");
     error_check();
 
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         current->size = q_descend(current->q);
+    }
     set_noallocate_mode(false);
 
     bool ok = true;
@@ -1213,6 +1823,9 @@ static bool do_reverseK(int argc, char *argv[])
     }
     error_check();
 
+    if (!writable(current))
+        return false;
+
     if (argc == 2) {
         if (!get_int(argv[1], &k)) {
             report(1, "Invalid number of K");
@@ -1224,8 +1837,10 @@ static bool do_reverseK(int argc, char *argv[])
     }
 
     set_noallocate_mode(true);
-    if (exception_setup(true))
+    if (exception_setup(true)) {
+        perf_window_begin();
         q_reverseK(current->q, k);
+    }
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -1246,10 +1861,18 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
-    int len = 0;
+    size_t len = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        if (!writable(ctx))
+            return false;
+    }
+
     set_noallocate_mode(true);
-    if (current && exception_setup(true))
+    if (current && exception_setup(true)) {
+        perf_window_begin();
         len = q_merge(&chain.head, descend);
+    }
     exception_cancel();
     set_noallocate_mode(false);
 
@@ -1322,13 +1945,56 @@ static bool is_circular()
     return true;
 }
 
+/* Rest of q_show() for a compressed queue, which decodes its strings */
+static bool show_compressed(int vlevel)
+{
+    bool ok = true;
+    size_t cnt = 0;
+    qc_cursor_t *cur = NULL;
+    const char *s;
+
+    /* Showing a queue is not an operation under test */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    if (exception_setup(true)) {
+        cur = qc_cursor_open(current->q);
+        fail_probability = saved_probability;
+        while (ok && cur && (s = qc_cursor_next(cur))) {
+            if (cnt < BIG_LIST_SIZE) {
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", s);
+                if (show_entropy) {
+                    report_noreturn(vlevel, "(%3.2f%%)",
+                                    shannon_entropy((const uint8_t *) s));
+                }
+            }
+            cnt++;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+    fail_probability = saved_probability;
+    qc_cursor_close(cur);
+
+    report(vlevel, cnt <= BIG_LIST_SIZE ? "]" : " ... ]");
+    if (!cur) {
+        report(vlevel, "ERROR:  Could not decode compressed queue");
+        return false;
+    }
+    if (ok && cnt != current->size) {
+        report(vlevel, "ERROR:  Queue has %zu elements instead of %zu", cnt,
+               current->size);
+        ok = false;
+    }
+    return ok;
+}
+
 static bool q_show(int vlevel)
 {
     bool ok = true;
     if (verblevel < vlevel)
         return true;
 
-    int cnt = 0;
+    size_t cnt = 0;
     if (!current || !current->q) {
         report(vlevel, "l = NULL");
         return true;
@@ -1341,6 +2007,9 @@ static bool q_show(int vlevel)
 
     report_noreturn(vlevel, "l = [");
 
+    if (q_compressed(current->q))
+        return show_compressed(vlevel);
+
     struct list_head *ori = current->q;
     struct list_head *cur = current->q->next;
 
@@ -1374,7 +2043,7 @@ static bool q_show(int vlevel)
             report(vlevel, " ... ]");
     } else {
         report(vlevel, " ... ]");
-        report(vlevel, "ERROR:  Queue has more than %d elements",
+        report(vlevel, "ERROR:  Queue has more than %zu elements",
                current->size);
         ok = false;
     }
@@ -1415,7 +2084,7 @@ static bool do_prev(int argc, char *argv[])
         current = prev ? list_entry(prev, queue_contex_t, chain) : NULL;
     }
 
-    return q_show(0);
+    return unshare(current) && q_show(0);
 }
 
 static bool do_next(int argc, char *argv[])
@@ -1438,22 +2107,83 @@ static bool do_next(int argc, char *argv[])
         current = next ? list_entry(next, queue_contex_t, chain) : NULL;
     }
 
-    return q_show(0);
+    return unshare(current) && q_show(0);
+}
+
+static void set_sort_mem(int oldval)
+{
+    if (sort_mem < 0) {
+        report(1, "Invalid memory budget %d", sort_mem);
+        sort_mem = oldval;
+    }
+    q_sort_memlimit((size_t) sort_mem * 1024);
+}
+
+static void set_lean(int oldval)
+{
+    q_lean_layout(lean);
+}
+
+static void set_async_free(int oldval)
+{
+    if (!async_free) {
+        reclaimer_stop();
+    } else if (!reclaimer_start()) {
+        report(1, "Could not start the reclaimer thread");
+        async_free = 0;
+    }
+}
+
+static void set_time_limit(int oldval)
+{
+    if (time_limit < 0) {
+        report(1, "Invalid time limit %d", time_limit);
+        time_limit = oldval;
+    }
+}
+
+static void set_perf(int oldval)
+{
+    if (!perf_counters) {
+        perf_close();
+        return;
+    }
+
+    int err = perf_open();
+    if (err) {
+        report(1, "Hardware counters unavailable: %s", strerror(err));
+        perf_counters = 0;
+    }
+}
+
+static void set_sort_algo(int oldval)
+{
+    if (sort_algo != Q_SORT_MERGE && sort_algo != Q_SORT_TIMSORT) {
+        report(1, "Unknown sorting algorithm %d", sort_algo);
+        sort_algo = oldval;
+    }
+    q_sort_select(sort_algo, true);
 }
 
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
     ADD_COMMAND(free, "Delete queue", "");
+    ADD_COMMAND(dup,
+                "Create a snapshot of queue, sharing its elements until "
+                "either is modified, which copies them all",
+                "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
     ADD_COMMAND(ih,
                 "Insert string str at head of queue n times. Generate random "
-                "string(s) if str equals RAND. (default: n == 1)",
+                "string(s) if str equals RAND. Insert the lines of file n if "
+                "str equals FILE. (default: n == 1)",
                 "str [n]");
     ADD_COMMAND(it,
                 "Insert string str at tail of queue n times. Generate random "
-                "string(s) if str equals RAND. (default: n == 1)",
+                "string(s) if str equals RAND. Insert the lines of file n if "
+                "str equals FILE. (default: n == 1)",
                 "str [n]");
     ADD_COMMAND(
         rh,
@@ -1467,13 +2197,37 @@ static void console_init()
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(timsort,
                 "Sort queue in ascending/descening order using timsort", "");
+    ADD_COMMAND(topk, "Sort only the first k elements of queue", "k");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
+    ADD_COMMAND(mergeview,
+                "Scan the first n elements of all queues in merged order "
+                "(default: all)",
+                "[n]");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
     ADD_COMMAND(shuffle, "Shuffle the list node", "");
+    ADD_COMMAND(compact, "Reallocate the nodes of queue in list order", "");
+    ADD_COMMAND(trim, "Release free heap memory and reorder free blocks", "");
+    ADD_COMMAND(compress,
+                "Store the strings of sorted queue front-coded, every k-th "
+                "whole (default: k == 16)",
+                "[k]");
+    ADD_COMMAND(decompress, "Turn a compressed queue back into nodes", "");
+    ADD_COMMAND(hist,
+                "Show the distribution of cycles taken by each insertion "
+                "and removal since 'option hist 1', or reset it",
+                "[reset]");
+    ADD_COMMAND(heapprof,
+                "Print the call stacks of allocations with their bytes, "
+                "count, live or peak live bytes, as folded stacks, or reset "
+                "them",
+                "[bytes | count | live | peak [file] | reset]");
+    ADD_COMMAND(save, "Save queue to a binary file", "file");
+    ADD_COMMAND(load, "Append the elements saved in a binary file to queue",
+                "file");
     ADD_COMMAND(ttt, "Start tic-tac-toe", "");
     ADD_COMMAND(ascend,
                 "Remove every node which has a node with a strictly less "
@@ -1489,20 +2243,60 @@ static void console_init()
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("poison", &poison_rate,
+              "Fill 1 in N blocks with a pattern on malloc and free "
+              "(0: canaries only)",
+              NULL);
+    add_param("guard", &guard_rate,
+              "Place 1 in N blocks, on average, before an inaccessible page "
+              "(0: none)",
+              NULL);
+    add_param("heapprof", &heap_profile,
+              "Record the call stack of each allocation for heapprof "
+              "(0: off, 1: on)",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sortalgo", &sort_algo,
+              "Algorithm of sort and merge (0: merge sort, 1: timsort)",
+              set_sort_algo);
+    add_param("sortmem", &sort_mem,
+              "Memory budget of sort in KiB, above which it uses temporary "
+              "files (0: no limit)",
+              set_sort_mem);
+    add_param("lean", &lean,
+              "Store each string in the block of its element (0: off, 1: on)",
+              set_lean);
+    add_param("asyncfree", &async_free,
+              "Free queues on a background thread, checking for leaks on quit "
+              "(0: off, 1: on)",
+              set_async_free);
+    add_param("timelimit", &time_limit,
+              "Seconds an operation may run before it is interrupted "
+              "(0: no limit)",
+              set_time_limit);
+    add_param("hist", &hist_ops,
+              "Time every insertion and removal in cycles for hist "
+              "(0: off, 1: on)",
+              NULL);
+    add_param("perf", &perf_counters,
+              "Report hardware counters of each operation (0: off, 1: on)",
+              set_perf);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+static void sigsegv_handler(int sig, siginfo_t *info, void *context)
 {
+    static const char fault[] = "Segmentation fault occurred.  ";
+    static const char invalid[] = "You dereferenced a NULL or invalid pointer";
+
     /* Avoid possible non-reentrant signal function be used in signal handler */
-    assert(write(1,
-                 "Segmentation fault occurred.  You dereferenced a NULL or "
-                 "invalid pointer",
-                 73) == 73);
+    assert(write(1, fault, sizeof(fault) - 1) == sizeof(fault) - 1);
+    /* Accesses caught by a guard page are traced back to their block */
+    if (!guard_report_fault(info->si_addr))
+        assert(write(1, invalid, sizeof(invalid) - 1) == sizeof(invalid) - 1);
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -1517,16 +2311,22 @@ static void sigalrm_handler(int sig)
 static void q_init()
 {
     fail_count = 0;
+    q_sort_select(sort_algo, true);
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    struct sigaction segv = {
+        .sa_sigaction = sigsegv_handler,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&segv.sa_mask);
+    sigaction(SIGSEGV, &segv, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
+    reclaimer_stop();
+
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1540,7 +2340,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
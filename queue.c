@@ -1,10 +1,132 @@
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "queue.h"
 
-//#define SORT_BY_KERNEL_API true
+/* Kernels specialized for each ordering direction */
+#define QT_NAME ascend
+#define QT_DESCEND 0
+#include "queue_template.h"
+
+#define QT_NAME descend
+#define QT_DESCEND 1
+#include "queue_template.h"
+
+/* Sorting kernels that also count comparisons */
+static size_t cmp_count = 0;
+
+#define QT_NAME ascend_counted
+#define QT_DESCEND 0
+#define QT_COUNTER cmp_count
+#include "queue_template.h"
+
+#define QT_NAME descend_counted
+#define QT_DESCEND 1
+#define QT_COUNTER cmp_count
+#include "queue_template.h"
+
+static q_sort_algo_t sort_algo = Q_SORT_MERGE;
+static bool sort_count = false;
+
+/* Memory budget of q_sort() in bytes, 0 for no limit */
+static size_t sort_mem = 0;
+
+/* Whether new elements hold their string in the same block */
+static bool lean_layout = false;
+
+/**
+ * fc_store_t - Strings of a compressed queue in blocked front coding
+ * @count: number of strings
+ * @block: number of strings per block
+ * @longest: length of the longest string
+ * @size: number of bytes used in @data
+ * @data: the encoded strings, in queue order
+ *
+ * The first string of every block is stored whole, as its length followed by
+ * its characters. Every other string is stored as the length of the prefix
+ * it shares with the string before it, the length of the rest, and the rest.
+ * Lengths are LEB128 varints, so short keys pay a byte per length. Strings are
+ * not NUL-terminated in @data; a decoder rebuilds each one in a buffer of
+ * @longest + 1 bytes from the one before it, and starts over at every block.
+ */
+typedef struct fc_store {
+    size_t count;
+    size_t block;
+    size_t longest;
+    size_t size;
+    unsigned char data[];
+} fc_store_t;
+
+/**
+ * queue_t - A queue as allocated by q_new()
+ * @head: the list head handed out to callers
+ * @sorted: last node of the sorted prefix, or NULL if it is not known
+ * @descend: whether the sorted prefix is in descending order
+ * @origin: queue whose elements this snapshot shares, NULL if it has its own
+ * @snapshots: snapshots sharing the elements of this queue
+ * @link: node in the @snapshots list of @origin
+ * @packed: front-coded strings of a compressed queue, NULL if it has elements
+ *
+ * Callers only ever see @head, so every function taking a queue recovers the
+ * rest with container_of(). The prefix from the first node through @sorted is
+ * kept sorted by the operations that preserve order, which lets q_sort() sort
+ * only the nodes behind it.
+ *
+ * A snapshot made by q_dup() keeps @head empty and reads the elements of
+ * @origin until q_unshare() copies them, so an origin never is a snapshot.
+ * A queue compressed by q_compress() keeps @head empty as well, and holds its
+ * strings in @packed until q_decompress() turns them back into elements.
+ */
+typedef struct queue {
+    struct list_head head;
+    struct list_head *sorted;
+    bool descend;
+    struct queue *origin;
+    struct list_head snapshots;
+    struct list_head link;
+    struct fc_store *packed;
+} queue_t;
+
+static inline queue_t *queue_of(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/* Whether @a may precede @b in the order of the sorted prefix of @q */
+static inline bool prefix_order(const queue_t *q,
+                                struct list_head *a,
+                                struct list_head *b)
+{
+    return q->descend ? qt_descend_before(a, b) : qt_ascend_before(a, b);
+}
+
+/* Mark the whole queue as sorted, or forget the prefix of an empty one */
+static inline void set_sorted(struct list_head *head, bool descend)
+{
+    queue_t *q = queue_of(head);
+    q->sorted = list_empty(head) ? NULL : head->prev;
+    q->descend = descend;
+}
+
+struct qc_cursor {
+    const fc_store_t *fc;
+    size_t index;
+    const unsigned char *pos;
+    char buf[];
+};
+
+struct qm_cursor {
+    size_t k;
+    bool descend;
+    size_t *tree;
+    qt_leaf_t leaf[];
+};
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -13,16 +135,64 @@
  */
 
 
+/* Allocate an element with room for a string of @len characters */
+static element_t *element_alloc(size_t len)
+{
+    element_t *el;
+
+    if (lean_layout) {
+        el = malloc(sizeof(element_t) + len + 1);
+        if (el) {
+            el->value = (char *) (el + 1);
+            el->lean = true;
+        }
+        return el;
+    }
+
+    el = malloc(sizeof(element_t));
+    if (!el)
+        return NULL;
+    el->lean = false;
+    el->value = malloc(len + 1);
+    if (!el->value) {
+        free(el);
+        return NULL;
+    }
+    return el;
+}
+
+/* Allocate an element holding a copy of @s */
+static element_t *element_new(const char *s)
+{
+    size_t len = strlen(s);
+    element_t *el = element_alloc(len);
+    if (el)
+        memcpy(el->value, s, len + 1);
+    return el;
+}
+
+/* Choose the memory layout of new elements */
+void q_lean_layout(bool lean)
+{
+    lean_layout = lean;
+}
+
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *q = malloc(sizeof(struct list_head));
+    queue_t *q = malloc(sizeof(queue_t));
     if (!q)
         return NULL;
 
-    INIT_LIST_HEAD(q);
+    INIT_LIST_HEAD(&q->head);
+    q->sorted = NULL;
+    q->descend = false;
+    q->origin = NULL;
+    INIT_LIST_HEAD(&q->snapshots);
+    INIT_LIST_HEAD(&q->link);
+    q->packed = NULL;
 
-    return q;
+    return &q->head;
 }
 
 /* Free all storage used by queue */
@@ -33,50 +203,71 @@ void q_free(struct list_head *head)
     if (!head)
         return;
 
+    queue_t *q = queue_of(head);
+    list_del(&q->link);
+
+    /* The elements outlive their queue while snapshots share them. The first
+     * snapshot inherits them and the others go on sharing with it.
+     */
+    if (!list_empty(&q->snapshots)) {
+        queue_t *heir = list_first_entry(&q->snapshots, queue_t, link);
+        list_del_init(&heir->link);
+        list_splice_init(&q->snapshots, &heir->snapshots);
+        queue_t *snap;
+        list_for_each_entry (snap, &heir->snapshots, link)
+            snap->origin = heir;
+        heir->origin = NULL;
+        list_splice(head, &heir->head);
+        heir->sorted = q->sorted;
+        heir->descend = q->descend;
+        free(q);
+        return;
+    }
+
     list_for_each_entry_safe (el, safe, head, list)
         q_release_element(el);
 
-    free(head);
+    free(q->packed);
+    free(q);
 }
 
 /* Insert an element at head of queue */
 bool q_insert_head(struct list_head *head, char *s)
 {
-    if (!head)
+    if (!head || q_shared(head))
         return false;
 
-    element_t *el = malloc(sizeof(element_t));
+    element_t *el = element_new(s);
     if (!el)
         return false;
 
-    el->value = strdup(s);
-    if (!el->value) {
-        free(el);
-        return false;
-    }
-
     list_add(&el->list, head);
 
+    /* The prefix survives only if the new element may precede it */
+    queue_t *q = queue_of(head);
+    if (q->sorted && !prefix_order(q, &el->list, el->list.next))
+        q->sorted = NULL;
+
     return true;
 }
 
 /* Insert an element at tail of queue */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (!head)
+    if (!head || q_shared(head))
         return false;
 
-    element_t *el = malloc(sizeof(element_t));
+    element_t *el = element_new(s);
     if (!el)
         return false;
 
-    el->value = strdup(s);
-    if (!el->value) {
-        free(el);
-        return false;
-    }
+    /* Appending to a fully sorted queue may extend its prefix */
+    queue_t *q = queue_of(head);
+    bool grow = q->sorted && q->sorted == head->prev;
 
     list_add_tail(&el->list, head);
+    if (grow && prefix_order(q, q->sorted, &el->list))
+        q->sorted = &el->list;
 
     return true;
 }
@@ -86,10 +277,13 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
     element_t *ele;
 
-    if (!head || list_empty(head))
+    if (!head || list_empty(head) || q_shared(head))
         return NULL;
 
     ele = list_first_entry(head, element_t, list);
+    queue_t *q = queue_of(head);
+    if (q->sorted == &ele->list)
+        q->sorted = NULL;
     if (sp) {
         size_t len = strlen(ele->value);
         if (len <= bufsize)
@@ -110,10 +304,13 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
     element_t *ele;
 
-    if (!head || list_empty(head))
+    if (!head || list_empty(head) || q_shared(head))
         return NULL;
 
     ele = list_last_entry(head, element_t, list);
+    queue_t *q = queue_of(head);
+    if (q->sorted == &ele->list)
+        q->sorted = ele->list.prev != head ? ele->list.prev : NULL;
     if (sp) {
         size_t len = strlen(ele->value);
         if (len <= bufsize)
@@ -130,12 +327,12 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 }
 
 /* Return number of elements in queue */
-int q_size(struct list_head *head)
+size_t q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int len = 0;
+    size_t len = 0;
     struct list_head *li;
 
     list_for_each (li, head)
@@ -148,7 +345,7 @@ bool q_delete_mid(struct list_head *head)
 {
     struct list_head *slow, *fast;
 
-    if (!head || list_empty(head))
+    if (!head || list_empty(head) || q_shared(head))
         return false;
 
     slow = head->next;
@@ -159,6 +356,10 @@ bool q_delete_mid(struct list_head *head)
         slow = slow->next;
     }
 
+    queue_t *q = queue_of(head);
+    if (q->sorted == slow)
+        q->sorted = slow->prev != head ? slow->prev : NULL;
+
     list_del(slow);
     q_release_element(list_entry(slow, element_t, list));
 
@@ -168,33 +369,19 @@ bool q_delete_mid(struct list_head *head)
 /* Delete all nodes that have duplicate string */
 bool q_delete_dup(struct list_head *head)
 {
-    element_t *el, *safe;
-    char *target = NULL;
-
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || list_empty(head) || list_is_singular(head) || q_shared(head))
         return false;
 
-    list_for_each_entry_safe (el, safe, head, list) {
-        if (el->list.next != head) {
-            if (strcmp(el->value, safe->value) == 0) {
-                if (target)
-                    free(target);
-                target = strdup(el->value);
-            }
-        }
-
-        /* Delete duplicate node and element */
-        if (target) {
-            if (strcmp(el->value, target) == 0) {
-                list_del(&el->list);
-                q_release_element(el);
-            }
-        }
-    }
-
-    /* Free the target if last node was deleted */
-    if (target)
-        free(target);
+    /* Deleting from a sorted queue keeps it sorted, otherwise the end of the
+     * prefix may be gone
+     */
+    queue_t *q = queue_of(head);
+    bool sorted = q->sorted == head->prev;
+    qt_ascend_dedup(head);
+    if (sorted)
+        set_sorted(head, q->descend);
+    else
+        q->sorted = NULL;
 
     return true;
 }
@@ -204,8 +391,9 @@ void q_swap(struct list_head *head)
 {
     struct list_head *node;
 
-    if (!head || list_empty(head))
+    if (!head || list_empty(head) || q_shared(head))
         return;
+    queue_of(head)->sorted = NULL;
     list_for_each (node, head) {
         if (node->next != head)
             list_move(node, node->next);
@@ -217,22 +405,34 @@ void q_reverse(struct list_head *head)
 {
     struct list_head *node, *safe;
 
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || list_empty(head) || list_is_singular(head) || q_shared(head))
         return;
 
+    /* A sorted queue reversed is sorted the other way round */
+    queue_t *q = queue_of(head);
+    bool sorted = q->sorted == head->prev;
+
     list_for_each_safe (node, safe, head) {
         list_move(node, head);
     }
+
+    if (sorted)
+        set_sorted(head, !q->descend);
+    else
+        q->sorted = NULL;
 }
 
 /* Reverse the nodes of the list k at a time */
 void q_reverseK(struct list_head *head, int k)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (!head || list_empty(head) || list_is_singular(head) || k <= 0 ||
+        q_shared(head))
         return;
 
+    queue_of(head)->sorted = NULL;
+
     struct list_head *tmp, *node, *safe;
-    int reverse_num = q_size(head) / k;
+    size_t reverse_num = q_size(head) / k;
     int cnt = 0;
 
     tmp = head;
@@ -249,457 +449,1357 @@ void q_reverseK(struct list_head *head, int k)
     }
 }
 
-#if SORT_BY_KERNEL_API
-typedef unsigned char u8;
-#define likely(x) __builtin_expect(!!(x), 1)
-#define unlikely(x) __builtin_expect(!!(x), 0)
-typedef int
-    __attribute__((nonnull(2, 3))) (*list_cmp_func_t)(void *,
-                                                      const struct list_head *,
-                                                      const struct list_head *);
+/* Select the algorithm used by q_sort */
+void q_sort_select(q_sort_algo_t algo, bool count)
+{
+    sort_algo = algo;
+    sort_count = count;
+}
 
-int sort_comp(void *p, const struct list_head *a, const struct list_head *b)
+/* Number of comparisons made by the last counted sort */
+size_t q_sort_comparisons()
 {
-    // cppcheck-suppress nullPointer
-    return strcmp(list_entry(a, element_t, list)->value,
-                  // cppcheck-suppress nullPointer
-                  list_entry(b, element_t, list)->value);
+    return cmp_count;
 }
 
-/*
- * Returns a list organized in an intermediate format suited
- * to chaining of merge() calls: null-terminated, no reserved or
- * sentinel head node, "prev" links not maintained.
- */
-__attribute__((nonnull(2, 3, 4))) static struct list_head *
-merge(void *priv, list_cmp_func_t cmp, struct list_head *a, struct list_head *b)
+/* Sort a whole list with the selected kernel, branching once per call */
+static void sort_list(struct list_head *head, bool descend)
 {
-    struct list_head *head = NULL, **tail = &head;
+    bool tim = sort_algo == Q_SORT_TIMSORT;
+    if (sort_count) {
+        if (descend && tim)
+            qt_descend_counted_timsort(head);
+        else if (descend)
+            qt_descend_counted_sort(head);
+        else if (tim)
+            qt_ascend_counted_timsort(head);
+        else
+            qt_ascend_counted_sort(head);
+    } else {
+        if (descend && tim)
+            qt_descend_timsort(head);
+        else if (descend)
+            qt_descend_sort(head);
+        else if (tim)
+            qt_ascend_timsort(head);
+        else
+            qt_ascend_sort(head);
+    }
+}
 
-    for (;;) {
-        /* if equal, take 'a' -- important for sort stability */
-        if (cmp(priv, a, b) <= 0) {
-            *tail = a;
-            tail = &a->next;
-            a = a->next;
-            if (!a) {
-                *tail = b;
-                break;
-            }
-        } else {
-            *tail = b;
-            tail = &b->next;
-            b = b->next;
-            if (!b) {
-                *tail = a;
-                break;
-            }
-        }
+/* Merge the sorted @prefix in front of the sorted list @head */
+static void merge_prefix(struct list_head *head,
+                         struct list_head *prefix,
+                         bool descend)
+{
+    if (sort_count) {
+        if (descend)
+            qt_descend_counted_merge_prefix(head, prefix);
+        else
+            qt_ascend_counted_merge_prefix(head, prefix);
+    } else {
+        if (descend)
+            qt_descend_merge_prefix(head, prefix);
+        else
+            qt_ascend_merge_prefix(head, prefix);
     }
-    return head;
 }
 
-/*
- * Combine final list merge with restoration of standard doubly-linked
- * list structure.  This approach duplicates code from merge(), but
- * runs faster than the tidier alternatives of either a separate final
- * prev-link restoration pass, or maintaining the prev links
- * throughout.
+/* Build the loser tree of a k-way merge */
+static void loser_build(size_t *tree, qt_leaf_t *leaf, size_t k, bool descend)
+{
+    if (sort_count) {
+        if (descend)
+            qt_descend_counted_loser_build(tree, leaf, k);
+        else
+            qt_ascend_counted_loser_build(tree, leaf, k);
+    } else {
+        if (descend)
+            qt_descend_loser_build(tree, leaf, k);
+        else
+            qt_ascend_loser_build(tree, leaf, k);
+    }
+}
+
+/* Replay the matches of leaf @s after it advanced */
+static void loser_adjust(size_t *tree,
+                         qt_leaf_t *leaf,
+                         size_t k,
+                         size_t s,
+                         bool descend)
+{
+    if (sort_count) {
+        if (descend)
+            qt_descend_counted_loser_adjust(tree, leaf, k, s);
+        else
+            qt_ascend_counted_loser_adjust(tree, leaf, k, s);
+    } else {
+        if (descend)
+            qt_descend_loser_adjust(tree, leaf, k, s);
+        else
+            qt_ascend_loser_adjust(tree, leaf, k, s);
+    }
+}
+
+/* External merge sort
+ *
+ * Above the memory budget, q_sort() cuts the queue into chunks of about the
+ * budget, sorts each in memory and writes it to a temporary file as a run of
+ * records, each a LEB128 length followed by the bytes of the string. The
+ * elements of a run are freed once it is written. The runs are then merged
+ * back through a loser tree, reading each with its own buffer of large
+ * sequential reads. The last chunk never leaves memory and takes part in the
+ * final merge directly.
  */
-__attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
-    void *priv,
-    list_cmp_func_t cmp,
-    struct list_head *head,
-    struct list_head *a,
-    struct list_head *b)
+
+/* Runs merged at once while runs are being formed */
+#define EXT_MAX_FANIN 64
+#define EXT_MAX_RUNS (2 * EXT_MAX_FANIN)
+
+/* Bounds of the read buffer of each run */
+#define EXT_MIN_BUFFER 4096
+#define EXT_MAX_BUFFER (1 << 20)
+
+/* Read buffer of a run whose own buffer could not be allocated */
+#define EXT_SPARE_BUFFER 256
+
+/* Allocations in a row that may fail while a run is recovered, before its
+ * remaining records are given up
+ */
+#define EXT_RECOVER_RETRIES 1024
+
+typedef struct {
+    FILE *file;
+    unsigned char *buf;
+    size_t size;    /* capacity of buf */
+    size_t len;     /* bytes in buf */
+    size_t pos;     /* read position in buf */
+    size_t pending; /* length of a record read but not yet given an element */
+    bool has_pending;
+    unsigned char spare[EXT_SPARE_BUFFER];
+} ext_run_t;
+
+/* Everything an external sort needs but the elements it reads back, which is
+ * allocated before anything is spilled
+ */
+typedef struct {
+    ext_run_t runs[EXT_MAX_RUNS];
+    qt_leaf_t leaf[EXT_MAX_RUNS + 1];
+    size_t tree[EXT_MAX_RUNS + 1];
+    size_t nruns;
+    bool descend;
+} ext_sort_t;
+
+typedef enum {
+    EXT_OK,
+    EXT_END,   /* no record left in the run */
+    EXT_NOMEM, /* no element for the next record, which a later read retries */
+    EXT_IOERR, /* the run cannot be read or written any further */
+} ext_status_t;
+
+/* Memory charged to an element against the budget */
+static inline size_t ext_footprint(const element_t *e)
+{
+    return sizeof(element_t) + strlen(e->value) + 1;
+}
+
+/* Append the string of @e to the run @f */
+static bool ext_write(FILE *f, const element_t *e)
 {
-    struct list_head *tail = head;
-    u8 count = 0;
+    size_t len = strlen(e->value);
 
-    for (;;) {
-        /* if equal, take 'a' -- important for sort stability */
-        if (cmp(priv, a, b) <= 0) {
-            tail->next = a;
-            a->prev = tail;
-            tail = a;
-            a = a->next;
-            if (!a)
-                break;
-        } else {
-            tail->next = b;
-            b->prev = tail;
-            tail = b;
-            b = b->next;
-            if (!b) {
-                b = a;
+    for (size_t v = len;; v >>= 7) {
+        int byte = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        if (putc(byte, f) == EOF)
+            return false;
+        if (v <= 0x7f)
+            break;
+    }
+    return fwrite(e->value, 1, len, f) == len;
+}
+
+/* Refill the buffer of @r, false at the end of the run or on error */
+static bool ext_fill(ext_run_t *r)
+{
+    if (r->pos < r->len)
+        return true;
+    r->len = fread(r->buf, 1, r->size, r->file);
+    r->pos = 0;
+    return r->len > 0;
+}
+
+/* Read the next record of @r into a new element at *@e. The length of a
+ * record whose element cannot be allocated is kept, so that the next call
+ * picks the record up where this one stopped.
+ */
+static ext_status_t ext_read(ext_run_t *r, element_t **e)
+{
+    if (!r->has_pending) {
+        size_t len = 0;
+        for (int shift = 0;; shift += 7) {
+            if (!ext_fill(r))
+                return shift || ferror(r->file) ? EXT_IOERR : EXT_END;
+            unsigned char byte = r->buf[r->pos++];
+            len |= (size_t) (byte & 0x7f) << shift;
+            if (!(byte & 0x80))
                 break;
-            }
         }
+        r->pending = len;
+        r->has_pending = true;
     }
 
-    /* Finish linking remainder of list b on to tail */
-    tail->next = b;
-    do {
-        /*
-         * If the merge is highly unbalanced (e.g. the input is
-         * already sorted), this loop may run many iterations.
-         * Continue callbacks to the client even though no
-         * element comparison is needed, so the client's cmp()
-         * routine can invoke cond_resched() periodically.
-         */
-        if (unlikely(!++count))
-            cmp(priv, b, b);
-        b->prev = tail;
-        tail = b;
-        b = b->next;
-    } while (b);
-
-    /* And the final links to make a circular doubly-linked list */
-    tail->next = head;
-    head->prev = tail;
-}
-
-/*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
+    size_t len = r->pending;
+    element_t *el = element_alloc(len);
+    if (!el)
+        return EXT_NOMEM;
+    r->has_pending = false;
+
+    for (size_t off = 0; off < len;) {
+        if (!ext_fill(r)) {
+            q_release_element(el);
+            return EXT_IOERR;
+        }
+        size_t n = r->len - r->pos < len - off ? r->len - r->pos : len - off;
+        memcpy(el->value + off, r->buf + r->pos, n);
+        r->pos += n;
+        off += n;
+    }
+    el->value[len] = '\0';
+
+    *e = el;
+    return EXT_OK;
+}
+
+/* Rewind the @k runs at @runs for reading through buffers of @size bytes, or
+ * through their spare buffer if one cannot be allocated
  */
-/**
- * list_sort - sort a list
- * @priv: private data, opaque to list_sort(), passed to @cmp
- * @head: the list to sort
- * @cmp: the elements comparison function
- *
- * The comparison function @cmp must return > 0 if @a should sort after
- * @b ("@a > @b" if you want an ascending sort), and <= 0 if @a should
- * sort before @b *or* their original order should be preserved.  It is
- * always called with the element that came first in the input in @a,
- * and list_sort is a stable sort, so it is not necessary to distinguish
- * the @a < @b and @a == @b cases.
- *
- * This is compatible with two styles of @cmp function:
- * - The traditional style which returns <0 / =0 / >0, or
- * - Returning a boolean 0/1.
- * The latter offers a chance to save a few cycles in the comparison
- * (which is used by e.g. plug_ctx_cmp() in block/blk-mq.c).
- *
- * A good way to write a multi-word comparison is::
- *
- *	if (a->high != b->high)
- *		return a->high > b->high;
- *	if (a->middle != b->middle)
- *		return a->middle > b->middle;
- *	return a->low > b->low;
- *
- *
- * This mergesort is as eager as possible while always performing at least
- * 2:1 balanced merges.  Given two pending sublists of size 2^k, they are
- * merged to a size-2^(k+1) list as soon as we have 2^k following elements.
- *
- * Thus, it will avoid cache thrashing as long as 3*2^k elements can
- * fit into the cache.  Not quite as good as a fully-eager bottom-up
- * mergesort, but it does use 0.2*n fewer comparisons, so is faster in
- * the common case that everything fits into L1.
- *
- *
- * The merging is controlled by "count", the number of elements in the
- * pending lists.  This is beautifully simple code, but rather subtle.
- *
- * Each time we increment "count", we set one bit (bit k) and clear
- * bits k-1 .. 0.  Each time this happens (except the very first time
- * for each bit, when count increments to 2^k), we merge two lists of
- * size 2^k into one list of size 2^(k+1).
- *
- * This merge happens exactly when the count reaches an odd multiple of
- * 2^k, which is when we have 2^k elements pending in smaller lists,
- * so it's safe to merge away two lists of size 2^k.
- *
- * After this happens twice, we have created two lists of size 2^(k+1),
- * which will be merged into a list of size 2^(k+2) before we create
- * a third list of size 2^(k+1), so there are never more than two pending.
- *
- * The number of pending lists of size 2^k is determined by the
- * state of bit k of "count" plus two extra pieces of information:
- *
- * - The state of bit k-1 (when k == 0, consider bit -1 always set), and
- * - Whether the higher-order bits are zero or non-zero (i.e.
- *   is count >= 2^(k+1)).
- *
- * There are six states we distinguish.  "x" represents some arbitrary
- * bits, and "y" represents some arbitrary non-zero bits:
- * 0:  00x: 0 pending of size 2^k;           x pending of sizes < 2^k
- * 1:  01x: 0 pending of size 2^k; 2^(k-1) + x pending of sizes < 2^k
- * 2: x10x: 0 pending of size 2^k; 2^k     + x pending of sizes < 2^k
- * 3: x11x: 1 pending of size 2^k; 2^(k-1) + x pending of sizes < 2^k
- * 4: y00x: 1 pending of size 2^k; 2^k     + x pending of sizes < 2^k
- * 5: y01x: 2 pending of size 2^k; 2^(k-1) + x pending of sizes < 2^k
- * (merge and loop back to state 2)
- *
- * We gain lists of size 2^k in the 2->3 and 4->5 transitions (because
- * bit k-1 is set while the more significant bits are non-zero) and
- * merge them away in the 5->2 transition.  Note in particular that just
- * before the 5->2 transition, all lower-order bits are 11 (state 3),
- * so there is one list of each smaller size.
+static bool ext_open(ext_run_t *runs, size_t k, size_t size)
+{
+    bool ok = true;
+    for (size_t i = 0; i < k; i++) {
+        ext_run_t *r = &runs[i];
+        r->buf = malloc(size);
+        r->size = size;
+        if (!r->buf) {
+            r->buf = r->spare;
+            r->size = sizeof(r->spare);
+        }
+        r->len = r->pos = 0;
+        r->has_pending = false;
+        ok = ok && !fflush(r->file) && !fseek(r->file, 0, SEEK_SET);
+    }
+    return ok;
+}
+
+/* Release the read buffers of the @k runs at @runs */
+static void ext_release(ext_run_t *runs, size_t k)
+{
+    for (size_t i = 0; i < k; i++) {
+        if (runs[i].buf != runs[i].spare)
+            free(runs[i].buf);
+        runs[i].buf = NULL;
+    }
+}
+
+/* Give leaf @leaf the next record of run @r, or NULL at its end */
+static ext_status_t ext_advance(ext_run_t *r, qt_leaf_t *leaf)
+{
+    element_t *e = NULL;
+    ext_status_t status = ext_read(r, &e);
+    leaf->pos = status == EXT_OK ? &e->list : NULL;
+    return status == EXT_END ? EXT_OK : status;
+}
+
+/* Merge the @k runs of @st from @first, and the sorted list @mem if not NULL,
+ * which goes after them in input order. The output is written to the run
+ * @out, or appended to @head if @out is NULL. The runs are left open for
+ * reading, and ext_release() must be called on them.
  *
- * When we reach the end of the input, we merge all the pending
- * lists, from smallest to largest.  If you work through cases 2 to
- * 5 above, you can see that the number of elements we merge with a list
- * of size 2^k varies from 2^(k-1) (cases 3 and 5 when x == 0) to
- * 2^(k+1) - 1 (second merge of case 5 when x == 2^(k-1) - 1).
+ * A failure stops the merge where it is. Whatever was merged stays in @head,
+ * and the leaves of @st keep the elements they were given, while the rest of
+ * @mem and the records not read yet stay where they are.
  */
-__attribute__((nonnull(2, 3))) void list_sort(void *priv,
-                                              struct list_head *head,
-                                              list_cmp_func_t cmp)
+static ext_status_t ext_merge(ext_sort_t *st,
+                              size_t first,
+                              size_t k,
+                              struct list_head *mem,
+                              FILE *out,
+                              struct list_head *head)
 {
-    struct list_head *list = head->next, *pending = NULL;
-    size_t count = 0; /* Count of pending */
+    ext_run_t *runs = &st->runs[first];
+    qt_leaf_t *leaf = st->leaf;
+    size_t n = k + (mem ? 1 : 0);
+    size_t size = sort_mem / (n + 1);
+    if (size < EXT_MIN_BUFFER)
+        size = EXT_MIN_BUFFER;
+    if (size > EXT_MAX_BUFFER)
+        size = EXT_MAX_BUFFER;
+
+    for (size_t i = 0; i < n; i++)
+        leaf[i].pos = NULL;
+    ext_status_t status = ext_open(runs, k, size) ? EXT_OK : EXT_IOERR;
+    for (size_t i = 0; i < k && status == EXT_OK; i++)
+        status = ext_advance(&runs[i], &leaf[i]);
+    if (mem)
+        leaf[k].pos = list_empty(mem) ? NULL : mem->next;
+    if (status != EXT_OK)
+        return status;
+    loser_build(st->tree, leaf, n, st->descend);
 
-    if (list == head->prev) /* Zero or one elements */
-        return;
+    for (;;) {
+        size_t w = st->tree[0];
+        struct list_head *node = leaf[w].pos;
+        if (!node)
+            break;
 
-    /* Convert to a null-terminated singly-linked list. */
-    head->prev->next = NULL;
-
-    /*
-     * Data structure invariants:
-     * - All lists are singly linked and null-terminated; prev
-     *   pointers are not maintained.
-     * - pending is a prev-linked "list of lists" of sorted
-     *   sublists awaiting further merging.
-     * - Each of the sorted sublists is power-of-two in size.
-     * - Sublists are sorted by size and age, smallest & newest at front.
-     * - There are zero to two sublists of each size.
-     * - A pair of pending sublists are merged as soon as the number
-     *   of following pending elements equals their size (i.e.
-     *   each time count reaches an odd multiple of that size).
-     *   That ensures each later final merge will be at worst 2:1.
-     * - Each round consists of:
-     *   - Merging the two sublists selected by the highest bit
-     *     which flips when count is incremented, and
-     *   - Adding an element from the input as a size-1 sublist.
-     */
-    do {
-        size_t bits;
-        struct list_head **tail = &pending;
-
-        /* Find the least-significant clear bit in count */
-        for (bits = count; bits & 1; bits >>= 1)
-            tail = &(*tail)->prev;
-        /* Do the indicated merge */
-        if (likely(bits)) {
-            struct list_head *a = *tail, *b = a->prev;
-
-            a = merge(priv, cmp, b, a);
-            /* Install the merged result in place of the inputs */
-            a->prev = b->prev;
-            *tail = a;
+        /* Nodes read back from a run are not linked yet */
+        element_t *e = list_entry(node, element_t, list);
+        if (w < k) {
+            if (!out)
+                list_add_tail(node, head);
+            else if (!ext_write(out, e))
+                status = EXT_IOERR;
+            if (out)
+                q_release_element(e);
+            if (status == EXT_OK)
+                status = ext_advance(&runs[w], &leaf[w]);
+            else
+                leaf[w].pos = NULL;
+        } else {
+            leaf[w].pos = node->next != mem ? node->next : NULL;
+            list_move_tail(node, head);
         }
+        if (status != EXT_OK)
+            return status;
+        loser_adjust(st->tree, leaf, n, w, st->descend);
+    }
 
-        /* Move one element from input list to pending */
-        list->prev = pending;
-        pending = list;
-        list = list->next;
-        pending->next = NULL;
-        count++;
-    } while (list);
-
-    /* End of input; merge together all the pending lists. */
-    list = pending;
-    pending = pending->prev;
-    for (;;) {
-        struct list_head *next = pending->prev;
+    return EXT_OK;
+}
 
-        if (!next)
-            break;
-        list = merge(priv, cmp, pending, list);
-        pending = next;
-    }
-    /* The final merge, rebuilding prev links */
-    merge_final(priv, cmp, head, pending, list);
-}
-
-#else
-
-static void merge_list(struct list_head *l1,
-                       struct list_head *l2,
-                       struct list_head **phead,
-                       bool descend,
-                       size_t cnt)
-{
-    struct list_head *ptr = (*phead);
-
-    while ((l1 != (*phead)) && (l2 != (*phead))) {
-        if (descend) {
-            if (strcmp(list_entry(l1, element_t, list)->value,
-                       list_entry(l2, element_t, list)->value) >= 0) {
-                ptr->next = l1;
-                l1->prev = ptr;
-                l1 = l1->next;
-            } else {
-                ptr->next = l2;
-                l2->prev = ptr;
-                l2 = l2->next;
-            }
-        } else {
-            if (strcmp(list_entry(l1, element_t, list)->value,
-                       list_entry(l2, element_t, list)->value) <= 0) {
-                ptr->next = l1;
-                l1->prev = ptr;
-                l1 = l1->next;
-            } else {
-                ptr->next = l2;
-                l2->prev = ptr;
-                l2 = l2->next;
-            }
+/* Merge the last @k runs of @st into one in their place */
+static bool ext_collapse(ext_sort_t *st, size_t k)
+{
+    size_t first = st->nruns - k;
+    FILE *f = tmpfile();
+    if (!f)
+        return false;
+
+    ext_status_t status = ext_merge(st, first, k, NULL, f, NULL);
+    ext_release(&st->runs[first], k);
+    if (status == EXT_OK && fflush(f))
+        status = EXT_IOERR;
+    if (status != EXT_OK) {
+        /* The runs are left intact, and read again from their start by the
+         * final merge. Only the copies read from them so far are dropped.
+         */
+        for (size_t i = 0; i < k; i++) {
+            if (st->leaf[i].pos)
+                q_release_element(
+                    list_entry(st->leaf[i].pos, element_t, list));
         }
-        ptr = ptr->next;
+        fclose(f);
+        return false;
     }
 
-    ptr->next = (l1 != (*phead)) ? l1 : l2;
-    (ptr->next)->prev = ptr;
+    for (size_t j = first; j < st->nruns; j++)
+        fclose(st->runs[j].file);
+    st->runs[first].file = f;
+    st->nruns = first + 1;
+    return true;
+}
 
-    if (cnt == 1) {
-        while (ptr->next != (*phead))
-            ptr = ptr->next;
-        (*phead)->prev = ptr;
+/* Finish a final merge of the @k runs of @st and of @mem into @head that
+ * failed. Every element the merge did not reach is gathered behind its output,
+ * which holds the first elements in order, and sorted in memory.
+ *
+ * The records left in the runs need the memory that spilling them gave back,
+ * so allocation failures are expected to be transient here, and are retried
+ * up to EXT_RECOVER_RETRIES times in a row. A run that cannot be read, or
+ * whose records still cannot be allocated, loses the records left in it, but
+ * everything recovered so far is put back into @head, where the loss shows
+ * in the size of the queue.
+ */
+static void ext_recover(ext_sort_t *st,
+                        size_t k,
+                        struct list_head *mem,
+                        struct list_head *head)
+{
+    LIST_HEAD(rest);
+
+    for (size_t i = 0; i < k; i++) {
+        if (st->leaf[i].pos)
+            list_add_tail(st->leaf[i].pos, &rest);
     }
+    list_splice_tail_init(mem, &rest);
+
+    for (size_t i = 0; i < k; i++) {
+        element_t *e;
+        ext_status_t status;
+        unsigned failures = 0;
+        while ((status = ext_read(&st->runs[i], &e)) != EXT_END) {
+            if (status == EXT_OK) {
+                list_add_tail(&e->list, &rest);
+                failures = 0;
+            } else if (status == EXT_IOERR ||
+                       ++failures == EXT_RECOVER_RETRIES) {
+                break;
+            }
+        }
+    }
+
+    if (!list_empty(&rest) && !list_is_singular(&rest))
+        sort_list(&rest, st->descend);
+    list_splice_tail(&rest, head);
 }
 
-static struct list_head *mergesort_list(struct list_head *node,
-                                        struct list_head **phead,
-                                        bool descend,
-                                        size_t cnt)
+/* Sort @head through temporary files, keeping about sort_mem bytes of
+ * elements in memory while runs are formed. Return false, with @head left as
+ * it was, if the sort cannot start.
+ */
+static bool ext_sort(struct list_head *head, bool descend)
 {
-    struct list_head *left, *right;
+    ext_sort_t *st = malloc(sizeof(ext_sort_t));
+    if (!st)
+        return false;
+    st->nruns = 0;
+    st->descend = descend;
+    LIST_HEAD(chunk);
 
-    if (!(*phead) || node->next == (*phead))
-        return node;
+    /* Form runs from all but the last chunk. Whenever there are twice as many
+     * runs as one merge takes, the latest ones are merged into one, which
+     * bounds the number of open files and read buffers.
+     */
+    while (!list_empty(head)) {
+        struct list_head *node = head->next;
+        size_t bytes = 0;
+        do {
+            bytes += ext_footprint(list_entry(node, element_t, list));
+            node = node->next;
+        } while (node != head && bytes < sort_mem);
+        if (node == head)
+            break;
 
-    struct list_head *slow = node;
-    struct list_head *fast = slow->next->next;
-    struct list_head *mid = NULL;
+        if (st->nruns == EXT_MAX_RUNS && !ext_collapse(st, EXT_MAX_FANIN))
+            break;
 
-    while ((fast->next != (*phead)) && (fast != (*phead))) {
-        slow = slow->next;
-        fast = fast->next->next;
+        FILE *f = tmpfile();
+        if (!f)
+            break;
+        list_cut_position(&chunk, head, node->prev);
+        if (!list_is_singular(&chunk))
+            sort_list(&chunk, descend);
+
+        element_t *e, *safe;
+        bool ok = true;
+        list_for_each_entry (e, &chunk, list) {
+            ok = ext_write(f, e);
+            if (!ok)
+                break;
+        }
+        if (!ok || fflush(f)) {
+            /* Give the chunk back and keep the rest in memory */
+            list_splice(&chunk, head);
+            fclose(f);
+            break;
+        }
+        list_for_each_entry_safe (e, safe, &chunk, list)
+            q_release_element(e);
+        INIT_LIST_HEAD(&chunk);
+        st->runs[st->nruns].file = f;
+        st->runs[st->nruns].buf = NULL;
+        st->nruns++;
     }
 
-    mid = slow->next;
-    slow->next = (*phead);
-
-    cnt++;
-    left = mergesort_list(node, phead, descend, cnt);
-    right = mergesort_list(mid, phead, descend, cnt);
+    /* Whatever is left is sorted in memory, and merged after the runs */
+    LIST_HEAD(mem);
+    list_splice_init(head, &mem);
+    if (!list_empty(&mem) && !list_is_singular(&mem))
+        sort_list(&mem, descend);
+
+    if (ext_merge(st, 0, st->nruns, &mem, NULL, head) != EXT_OK)
+        ext_recover(st, st->nruns, &mem, head);
+    ext_release(st->runs, st->nruns);
+    for (size_t i = 0; i < st->nruns; i++)
+        fclose(st->runs[i].file);
+    free(st);
+    return true;
+}
 
-    merge_list(left, right, phead, descend, cnt);
+/* Set the memory budget of q_sort() */
+void q_sort_memlimit(size_t bytes)
+{
+    sort_mem = bytes;
+}
 
-    return (*phead)->next;
+/* Forget the sorted prefix of a queue rearranged by the caller */
+void q_mark_unsorted(struct list_head *head)
+{
+    if (head)
+        queue_of(head)->sorted = NULL;
 }
-#endif
 
 /* Sort elements of queue in ascending/descending order */
 void q_sort(struct list_head *head, bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
+    if (sort_count)
+        cmp_count = 0;
+
+    if (!head || list_empty(head) || list_is_singular(head) || q_shared(head))
         return;
 
-#if defined(SORT_BY_KERNEL_API)
-    list_sort(NULL, head, sort_comp);
-#else
+    /* Only the nodes behind a sorted prefix in the same order need sorting,
+     * after which they are merged into the prefix in one pass.
+     */
+    queue_t *q = queue_of(head);
+    struct list_head *mark = q->descend == descend ? q->sorted : NULL;
+    if (mark == head->prev)
+        return;
+
+    /* Spill to temporary files if the queue exceeds the memory budget */
+    if (sort_mem) {
+        size_t bytes = 0;
+        struct list_head *node;
+        list_for_each (node, head) {
+            bytes += ext_footprint(list_entry(node, element_t, list));
+            if (bytes > sort_mem)
+                break;
+        }
+        if (bytes > sort_mem && ext_sort(head, descend)) {
+            set_sorted(head, descend);
+            return;
+        }
+    }
+
+    LIST_HEAD(prefix);
+    if (mark)
+        list_cut_position(&prefix, head, mark);
+    if (!list_is_singular(head))
+        sort_list(head, descend);
+    merge_prefix(head, &prefix, descend);
+
+    set_sorted(head, descend);
+}
+
+/* Move the k first elements in sorted order to the front of queue */
+bool q_sort_topk(struct list_head *head, size_t k, bool descend)
+{
+    if (sort_count)
+        cmp_count = 0;
+
+    if (!head || !k || q_shared(head))
+        return false;
+
+    size_t n = q_size(head);
+    if (k >= n) {
+        q_sort(head, descend);
+        return true;
+    }
 
-    struct list_head **phead = &head;
-    (*phead)->next = mergesort_list((*phead)->next, phead, descend, 0);
-    (*phead)->next->prev = (*phead);
+    qt_rank_t *heap = malloc(k * sizeof(qt_rank_t));
+    if (!heap)
+        return false;
 
-#endif
+    if (sort_count) {
+        if (descend)
+            qt_descend_counted_topk(head, heap, k);
+        else
+            qt_ascend_counted_topk(head, heap, k);
+    } else {
+        if (descend)
+            qt_descend_topk(head, heap, k);
+        else
+            qt_ascend_topk(head, heap, k);
+    }
+
+    /* The winners are a sorted prefix, which a later q_sort() builds on */
+    queue_t *q = queue_of(head);
+    q->sorted = heap[k - 1].node;
+    q->descend = descend;
+
+    free(heap);
+    return true;
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
  * the right side of it */
-int q_ascend(struct list_head *head)
+size_t q_ascend(struct list_head *head)
 {
-    element_t *cur = NULL, *target, *prev = NULL;
-    struct list_head *pos = NULL;
+    if (!head || list_empty(head) || q_shared(head))
+        return 0;
+
+    size_t n = qt_ascend_monotone(head);
+    set_sorted(head, false);
+    return n;
+}
 
-    if (!head || list_empty(head) || list_is_singular(head))
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+size_t q_descend(struct list_head *head)
+{
+    if (!head || list_empty(head) || q_shared(head))
         return 0;
 
-    list_for_each_entry (cur, head, list) {
-        /* Release the element in the next round */
-        if (prev) {
-            q_release_element(prev);
-            prev = NULL;
+    size_t n = qt_descend_monotone(head);
+    set_sorted(head, true);
+    return n;
+}
+
+/* Queues merged at once by q_merge(), bounded so the loser tree fits on the
+ * stack. Longer chains are merged in rounds into the first queue.
+ */
+#define MERGE_FANIN 64
+
+/* Merge all the queues into one sorted queue, which is in ascending/descending
+ * order */
+size_t q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    /* Nodes are moved between the queues, none of which may share them */
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain) {
+        if (q_shared(ctx->q))
+            return 0;
+    }
+    if (list_is_singular(head))
+        return q_size(first->q);
+
+    ctx = first;
+    qt_leaf_t leaf[MERGE_FANIN];
+    size_t tree[MERGE_FANIN];
+    LIST_HEAD(merged);
+
+    /* Each round merges what the first queue holds so far with up to
+     * MERGE_FANIN - 1 more queues, moving nodes without allocating.
+     */
+    do {
+        list_splice_init(first->q, &merged);
+        leaf[0].head = &merged;
+        leaf[0].pos = list_empty(&merged) ? NULL : merged.next;
+
+        size_t k = 1;
+        while (k < MERGE_FANIN && ctx->chain.next != head) {
+            ctx = list_entry(ctx->chain.next, queue_contex_t, chain);
+            leaf[k].head = ctx->q;
+            leaf[k].pos = list_empty(ctx->q) ? NULL : ctx->q->next;
+            queue_of(ctx->q)->sorted = NULL;
+            k++;
         }
 
-        /* Check right side and find if there is greater value */
-        if (cur->list.next)
-            pos = cur->list.next;
-        for (; pos != head; pos = pos->next) {
-            target = list_entry(pos, element_t, list);
-            if (strcmp(cur->value, target->value) > 0) {
-                list_del(&cur->list);
-                prev = cur;
+        loser_build(tree, leaf, k, descend);
+        for (;;) {
+            size_t w = tree[0];
+            struct list_head *node = leaf[w].pos;
+            if (!node)
                 break;
-            }
+            leaf[w].pos = node->next != leaf[w].head ? node->next : NULL;
+            list_move_tail(node, first->q);
+            loser_adjust(tree, leaf, k, w, descend);
         }
+    } while (ctx->chain.next != head);
+
+    set_sorted(first->q, descend);
+    return q_size(first->q);
+}
+
+/* Open a cursor over the merged order of all queues in the chain */
+qm_cursor_t *qm_cursor_open(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head))
+        return NULL;
+
+    size_t k = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain)
+        k++;
+
+    qm_cursor_t *cur =
+        malloc(sizeof(qm_cursor_t) + k * (sizeof(qt_leaf_t) + sizeof(size_t)));
+    if (!cur)
+        return NULL;
+
+    cur->k = k;
+    cur->descend = descend;
+    cur->tree = (size_t *) &cur->leaf[k];
+
+    /* Snapshots are read from the queue they share elements with */
+    size_t i = 0;
+    list_for_each_entry (ctx, head, chain) {
+        queue_t *q = queue_of(ctx->q);
+        struct list_head *elements = q->origin ? &q->origin->head : ctx->q;
+        cur->leaf[i].head = elements;
+        cur->leaf[i].pos = list_empty(elements) ? NULL : elements->next;
+        i++;
     }
 
-    return q_size(head);
+    if (sort_count) {
+        cmp_count = 0;
+        if (descend)
+            qt_descend_counted_loser_build(cur->tree, cur->leaf, k);
+        else
+            qt_ascend_counted_loser_build(cur->tree, cur->leaf, k);
+    } else {
+        if (descend)
+            qt_descend_loser_build(cur->tree, cur->leaf, k);
+        else
+            qt_ascend_loser_build(cur->tree, cur->leaf, k);
+    }
+
+    return cur;
 }
 
-/* Remove every node which has a node with a strictly greater value anywhere to
- * the right side of it */
-int q_descend(struct list_head *head)
+/* Get the next element in merged order */
+element_t *qm_cursor_next(qm_cursor_t *cur)
+{
+    struct list_head *node;
+
+    if (!cur)
+        return NULL;
+
+    if (sort_count) {
+        node = cur->descend
+                   ? qt_descend_counted_loser_next(cur->tree, cur->leaf, cur->k)
+                   : qt_ascend_counted_loser_next(cur->tree, cur->leaf, cur->k);
+    } else {
+        node = cur->descend
+                   ? qt_descend_loser_next(cur->tree, cur->leaf, cur->k)
+                   : qt_ascend_loser_next(cur->tree, cur->leaf, cur->k);
+    }
+
+    return node ? list_entry(node, element_t, list) : NULL;
+}
+
+/* Release a merge cursor */
+void qm_cursor_close(qm_cursor_t *cur)
+{
+    free(cur);
+}
+
+/* Copy the elements of @src in order to the empty list @dst, and find the copy
+ * of the last node of its sorted prefix. On failure @dst is left empty.
+ */
+static bool copy_elements(const queue_t *src,
+                          struct list_head *dst,
+                          struct list_head **sorted)
+{
+    element_t *e, *safe;
+
+    *sorted = NULL;
+    list_for_each_entry (e, &src->head, list) {
+        element_t *copy = element_new(e->value);
+        if (!copy) {
+            list_for_each_entry_safe (e, safe, dst, list)
+                q_release_element(e);
+            INIT_LIST_HEAD(dst);
+            return false;
+        }
+        list_add_tail(&copy->list, dst);
+        if (&e->list == src->sorted)
+            *sorted = &copy->list;
+    }
+    return true;
+}
+
+/* Reallocate every element in list order */
+bool q_compact(struct list_head *head)
+{
+    if (!head || q_shared(head))
+        return false;
+
+    /* All copies are made before any block is freed, so that the allocator
+     * hands them out from fresh memory instead of from the holes left behind.
+     */
+    queue_t *q = queue_of(head);
+    struct list_head *sorted;
+    element_t *e, *safe;
+    LIST_HEAD(fresh);
+
+    if (!copy_elements(q, &fresh, &sorted))
+        return false;
+
+    list_for_each_entry_safe (e, safe, head, list)
+        q_release_element(e);
+    INIT_LIST_HEAD(head);
+    list_splice(&fresh, head);
+    q->sorted = sorted;
+    return true;
+}
+
+/* Create a snapshot sharing the elements of queue */
+struct list_head *q_dup(struct list_head *head)
+{
+    if (!head)
+        return NULL;
+
+    struct list_head *dup = q_new();
+    if (!dup)
+        return NULL;
+
+    queue_t *q = queue_of(head), *snap = queue_of(dup);
+
+    /* Front-coded strings are copied as they are, in a single block */
+    if (q->packed) {
+        size_t size = sizeof(fc_store_t) + q->packed->size;
+        snap->packed = malloc(size);
+        if (!snap->packed) {
+            q_free(dup);
+            return NULL;
+        }
+        memcpy(snap->packed, q->packed, size);
+        snap->descend = q->descend;
+        return dup;
+    }
+
+    if (q->origin)
+        q = q->origin;
+    snap->origin = q;
+    list_add_tail(&snap->link, &q->snapshots);
+    return dup;
+}
+
+/* Give a snapshot the copy of its elements */
+static bool materialize(queue_t *snap)
+{
+    struct list_head *sorted;
+
+    if (!copy_elements(snap->origin, &snap->head, &sorted))
+        return false;
+    snap->sorted = sorted;
+    snap->descend = snap->origin->descend;
+    snap->origin = NULL;
+    list_del_init(&snap->link);
+    return true;
+}
+
+/* Stop sharing elements between queue and its origin or snapshots */
+bool q_unshare(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = queue_of(head);
+    if (q->origin && !materialize(q))
+        return false;
+
+    queue_t *snap, *safe;
+    list_for_each_entry_safe (snap, safe, &q->snapshots, link) {
+        if (!materialize(snap))
+            return false;
+    }
+    return true;
+}
+
+/* Whether queue shares its elements */
+bool q_shared(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = queue_of(head);
+    return q->origin || !list_empty(&q->snapshots);
+}
+
+/* Strings per block when q_compress() is not given a block size */
+#define FC_DEFAULT_BLOCK 16
+
+/* Number of bytes @v takes as a LEB128 varint */
+static inline size_t varint_size(size_t v)
+{
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7)
+        n++;
+    return n;
+}
+
+static inline unsigned char *varint_put(unsigned char *p, size_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (unsigned char) (v | 0x80);
+    *p++ = (unsigned char) v;
+    return p;
+}
+
+static inline const unsigned char *varint_get(const unsigned char *p,
+                                              size_t *v)
+{
+    size_t r = 0;
+    unsigned shift = 0;
+    for (; *p & 0x80; shift += 7)
+        r |= (size_t) (*p++ & 0x7f) << shift;
+    *v = r | (size_t) *p++ << shift;
+    return p;
+}
+
+/* Length of the prefix shared by @a and @b */
+static inline size_t common_prefix(const char *a, const char *b)
+{
+    size_t n = 0;
+    while (a[n] && a[n] == b[n])
+        n++;
+    return n;
+}
+
+/* Replace the elements of a sorted queue by their front coding */
+bool q_compress(struct list_head *head, size_t block)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = queue_of(head);
+    if (q->packed)
+        return true;
+    if (q_shared(head) || (!list_empty(head) && q->sorted != head->prev))
+        return false;
+    if (!block)
+        block = FC_DEFAULT_BLOCK;
+
+    /* Size the encoding first, so that it is written into a single block */
+    size_t count = 0, longest = 0, size = 0;
+    const char *prev = NULL;
+    element_t *e, *safe;
+    list_for_each_entry (e, head, list) {
+        size_t len = strlen(e->value), shared = 0;
+        if (count++ % block) {
+            shared = common_prefix(prev, e->value);
+            size += varint_size(shared);
+        }
+        size += varint_size(len - shared) + len - shared;
+        if (len > longest)
+            longest = len;
+        prev = e->value;
+    }
+
+    fc_store_t *fc = malloc(sizeof(fc_store_t) + size);
+    if (!fc)
+        return false;
+    fc->count = count;
+    fc->block = block;
+    fc->longest = longest;
+    fc->size = size;
+
+    unsigned char *p = fc->data;
+    size_t i = 0;
+    list_for_each_entry (e, head, list) {
+        size_t len = strlen(e->value), shared = 0;
+        if (i++ % block) {
+            shared = common_prefix(prev, e->value);
+            p = varint_put(p, shared);
+        }
+        p = varint_put(p, len - shared);
+        memcpy(p, e->value + shared, len - shared);
+        p += len - shared;
+        prev = e->value;
+    }
+
+    list_for_each_entry_safe (e, safe, head, list)
+        q_release_element(e);
+    INIT_LIST_HEAD(head);
+    q->sorted = NULL;
+    q->packed = fc;
+    return true;
+}
+
+/* Turn the strings of a compressed queue back into elements */
+bool q_decompress(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = queue_of(head);
+    if (!q->packed)
+        return true;
+
+    qc_cursor_t *cur = qc_cursor_open(head);
+    if (!cur)
+        return false;
+
+    LIST_HEAD(fresh);
+    const char *s;
+    while ((s = qc_cursor_next(cur))) {
+        element_t *e = element_new(s), *safe;
+        if (!e) {
+            list_for_each_entry_safe (e, safe, &fresh, list)
+                q_release_element(e);
+            qc_cursor_close(cur);
+            return false;
+        }
+        list_add_tail(&e->list, &fresh);
+    }
+    qc_cursor_close(cur);
+
+    list_splice(&fresh, head);
+    free(q->packed);
+    q->packed = NULL;
+    set_sorted(head, q->descend);
+    return true;
+}
+
+/* Whether queue holds its strings front-coded */
+bool q_compressed(struct list_head *head)
+{
+    return head && queue_of(head)->packed;
+}
+
+/* Get the number of strings in a compressed queue */
+size_t qc_size(struct list_head *head)
 {
-    element_t *cur = NULL, *target, *prev = NULL;
-    struct list_head *pos = NULL;
+    return q_compressed(head) ? queue_of(head)->packed->count : 0;
+}
 
-    if (!head || list_empty(head) || list_is_singular(head))
+/* Bytes of memory held by queue, not counting allocator overhead */
+size_t q_footprint(struct list_head *head)
+{
+    if (!head)
         return 0;
 
-    list_for_each_entry (cur, head, list) {
-        /* Release the element in the next round */
-        if (prev) {
-            q_release_element(prev);
-            prev = NULL;
+    queue_t *q = queue_of(head);
+    size_t bytes = sizeof(queue_t);
+    if (q->packed)
+        return bytes + sizeof(fc_store_t) + q->packed->size;
+
+    element_t *e;
+    list_for_each_entry (e, head, list)
+        bytes += sizeof(element_t) + strlen(e->value) + 1;
+    return bytes;
+}
+
+/* Start decoding the strings of a compressed queue */
+qc_cursor_t *qc_cursor_open(struct list_head *head)
+{
+    if (!q_compressed(head))
+        return NULL;
+
+    const fc_store_t *fc = queue_of(head)->packed;
+    qc_cursor_t *cur = malloc(sizeof(qc_cursor_t) + fc->longest + 1);
+    if (!cur)
+        return NULL;
+    cur->fc = fc;
+    cur->index = 0;
+    cur->pos = fc->data;
+    return cur;
+}
+
+/* Decode the next string, in place of the one before it */
+const char *qc_cursor_next(qc_cursor_t *cur)
+{
+    if (!cur || cur->index == cur->fc->count)
+        return NULL;
+
+    size_t shared = 0, rest;
+    const unsigned char *p = cur->pos;
+    if (cur->index++ % cur->fc->block)
+        p = varint_get(p, &shared);
+    p = varint_get(p, &rest);
+    memcpy(cur->buf + shared, p, rest);
+    cur->buf[shared + rest] = '\0';
+    cur->pos = p + rest;
+    return cur->buf;
+}
+
+void qc_cursor_close(qc_cursor_t *cur)
+{
+    free(cur);
+}
+
+
+/**
+ * q_file_header_t - Header of a file written by q_save()
+ * @magic: QFILE_MAGIC, which also tells the byte order apart
+ * @version: QFILE_VERSION
+ * @descend: whether the sorted prefix is in descending order
+ * @count: number of elements
+ * @sorted: number of elements in the sorted prefix
+ * @blob_size: size of the string blob in bytes
+ *
+ * The header is followed by the blob, which holds for every element in queue
+ * order the 32-bit length of its string and the characters, including the
+ * NUL, so that strings are copied out without scanning them. After the blob,
+ * padded to 8 bytes, comes a table of @count 64-bit offsets into it. This
+ * order lets q_save() write the strings in a single walk over the queue.
+ */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t descend;
+    uint64_t count;
+    uint64_t sorted;
+    uint64_t blob_size;
+} q_file_header_t;
+
+#define QFILE_MAGIC 0x3145554555514230ULL /* "0BQUEUE1" */
+#define QFILE_VERSION 1
+#define QFILE_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+/* Append the offsets table of the blob just written to @f */
+static bool qfile_write_offsets(FILE *f, const q_file_header_t *hdr)
+{
+    size_t size = sizeof(*hdr) + hdr->blob_size;
+    if (fflush(f))
+        return false;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    /* The blob is read back from the page cache, sequentially */
+    const char *blob = map + sizeof(*hdr);
+    uint64_t buf[512], off = 0;
+    size_t n = 0;
+    bool ok = true;
+    while (ok && off < hdr->blob_size) {
+        uint32_t len;
+        memcpy(&len, blob + off, sizeof(len));
+        buf[n++] = off;
+        off += sizeof(len) + len + 1;
+        if (n == 512 || off >= hdr->blob_size) {
+            ok = fwrite(buf, sizeof(buf[0]), n, f) == n;
+            n = 0;
         }
+    }
+    munmap(map, size);
+    return ok;
+}
+
+/* Append string @s to the blob of @f, counting it in @hdr. Fails on strings
+ * whose length does not fit the 32-bit length field.
+ */
+static bool qfile_write_string(FILE *f,
+                               q_file_header_t *hdr,
+                               const char *s,
+                               bool sorted)
+{
+    size_t n = strlen(s);
+    if (n > UINT32_MAX)
+        return false;
+    uint32_t len = n;
+    hdr->count++;
+    hdr->sorted += sorted;
+    hdr->blob_size += sizeof(len) + len + 1;
+    return fwrite(&len, sizeof(len), 1, f) == 1 &&
+           fwrite(s, 1, len + 1, f) == len + 1;
+}
 
-        /* Check right side and find if there is greater value */
-        if (cur->list.next)
-            pos = cur->list.next;
-        for (; pos != head; pos = pos->next) {
-            target = list_entry(pos, element_t, list);
-            if (strcmp(cur->value, target->value) < 0) {
-                list_del(&cur->list);
-                prev = cur;
+/* Save queue to a file */
+bool q_save(struct list_head *head, const char *path)
+{
+    if (!head || !path || queue_of(head)->origin)
+        return false;
+
+    FILE *f = fopen(path, "w+b");
+    if (!f)
+        return false;
+
+    queue_t *q = queue_of(head);
+    q_file_header_t hdr = {
+        .magic = QFILE_MAGIC,
+        .version = QFILE_VERSION,
+        .descend = q->descend,
+    };
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    if (q->packed) {
+        /* A compressed queue is sorted throughout and decoded as it is saved */
+        qc_cursor_t *cur = qc_cursor_open(head);
+        const char *s;
+        ok = ok && cur;
+        while (ok && (s = qc_cursor_next(cur)))
+            ok = qfile_write_string(f, &hdr, s, true);
+        qc_cursor_close(cur);
+    } else {
+        element_t *e;
+        bool prefix = q->sorted != NULL;
+        list_for_each_entry (e, head, list) {
+            if (!ok)
                 break;
-            }
+            ok = qfile_write_string(f, &hdr, e->value, prefix);
+            prefix = prefix && &e->list != q->sorted;
         }
     }
 
-    return q_size(head);
+    static const char pad[8];
+    size_t padding = QFILE_ALIGN(hdr.blob_size) - hdr.blob_size;
+    ok = ok && fwrite(pad, 1, padding, f) == padding &&
+         qfile_write_offsets(f, &hdr) && !fseek(f, 0, SEEK_SET) &&
+         fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+
+    ok = !fclose(f) && ok;
+    if (!ok)
+        unlink(path);
+    return ok;
 }
 
-/* Merge all the queues into one sorted queue, which is in ascending/descending
- * order */
-int q_merge(struct list_head *head, bool descend)
+/* Check that the mapped file at @map of @size bytes holds a valid queue */
+static bool qfile_valid(const char *map, size_t size)
 {
-    if (!head || list_empty(head))
-        return 0;
-    if (list_is_singular(head))
-        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
+    const q_file_header_t *hdr = (const q_file_header_t *) map;
+    if (size < sizeof(*hdr) || hdr->magic != QFILE_MAGIC ||
+        hdr->version != QFILE_VERSION || hdr->sorted > hdr->count ||
+        hdr->blob_size > size - sizeof(*hdr) ||
+        hdr->count > (size - sizeof(*hdr) - QFILE_ALIGN(hdr->blob_size)) /
+                         sizeof(uint64_t) ||
+        size != sizeof(*hdr) + QFILE_ALIGN(hdr->blob_size) +
+                    hdr->count * sizeof(uint64_t))
+        return false;
+
+    const char *blob = map + sizeof(*hdr);
+    const uint64_t *offsets =
+        (const uint64_t *) (blob + QFILE_ALIGN(hdr->blob_size));
+    for (uint64_t i = 0; i < hdr->count; i++) {
+        uint32_t len;
+        if (hdr->blob_size < sizeof(len) ||
+            offsets[i] > hdr->blob_size - sizeof(len))
+            return false;
+        memcpy(&len, blob + offsets[i], sizeof(len));
+        if (len >= hdr->blob_size - offsets[i] - sizeof(len) ||
+            blob[offsets[i] + sizeof(len) + len])
+            return false;
+    }
+    return true;
+}
 
-    queue_contex_t *first, *target = NULL;
-    first = list_first_entry(head, queue_contex_t, chain);
+/* Append the elements saved in a file to queue */
+bool q_load(struct list_head *head, const char *path)
+{
+    if (!head || !path || q_shared(head))
+        return false;
 
-    /* For move each target's queue to first context''s queue */
-    list_for_each_entry (target, head->next, chain) {
-        if (target->id == first->id)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(q_file_header_t)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (!qfile_valid(map, size)) {
+        munmap(map, size);
+        return false;
+    }
+
+    /* The elements are built apart, so that a failed allocation leaves the
+     * queue as it was
+     */
+    const q_file_header_t *hdr = (const q_file_header_t *) map;
+    const char *blob = map + sizeof(*hdr);
+    const uint64_t *offsets =
+        (const uint64_t *) (blob + QFILE_ALIGN(hdr->blob_size));
+    struct list_head *sorted = NULL;
+    LIST_HEAD(loaded);
+    bool ok = true, in_order = true;
+
+    for (uint64_t i = 0; i < hdr->count; i++) {
+        uint32_t len;
+        memcpy(&len, blob + offsets[i], sizeof(len));
+        element_t *e = element_alloc(len);
+        if (!e) {
+            ok = false;
             break;
-        list_splice_tail_init(target->q, first->q);
+        }
+        memcpy(e->value, blob + offsets[i] + sizeof(len), len + 1);
+        list_add_tail(&e->list, &loaded);
+
+        /* The saved prefix is only trusted once its order is checked */
+        if (i > 0 && i < hdr->sorted) {
+            int cmp = strcmp(list_entry(e->list.prev, element_t, list)->value,
+                             e->value);
+            in_order = in_order && (hdr->descend ? cmp >= 0 : cmp <= 0);
+        }
+        if (i + 1 == hdr->sorted && in_order)
+            sorted = &e->list;
+    }
+
+    if (ok) {
+        /* The saved prefix holds only if nothing goes before it */
+        queue_t *q = queue_of(head);
+        if (list_empty(head)) {
+            q->sorted = sorted;
+            q->descend = hdr->descend;
+        }
+        list_splice_tail(&loaded, head);
+    } else {
+        element_t *e, *safe;
+        list_for_each_entry_safe (e, safe, &loaded, list)
+            q_release_element(e);
+    }
+
+    munmap(map, size);
+    return ok;
+}
+
+/* Insert every line of a file */
+bool q_insert_file(struct list_head *head,
+                   const char *path,
+                   bool tail,
+                   size_t *count)
+{
+    *count = 0;
+    if (!head || !path || q_shared(head))
+        return false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return false;
     }
-    q_sort(first->q, descend);
-    head = first->q;
+    size_t size = st.st_size;
+    if (!size) {
+        close(fd);
+        return true;
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, size, MADV_SEQUENTIAL);
 
-    return q_size(head);
+    /* Lines are found with memchr(), which libc vectorizes, and copied with
+     * their known length into elements built apart from the queue
+     */
+    const char *p = map, *end = map + size;
+    LIST_HEAD(lines);
+    bool ok = true;
+    size_t n = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        element_t *e = element_alloc(len);
+        if (!e) {
+            ok = false;
+            break;
+        }
+        memcpy(e->value, p, len);
+        e->value[len] = '\0';
+        if (tail)
+            list_add_tail(&e->list, &lines);
+        else
+            list_add(&e->list, &lines);
+        n++;
+        p += len + 1;
+    }
+    munmap(map, size);
+
+    /* Lines before the sorted prefix void it, as in q_insert_head() */
+    if (tail) {
+        list_splice_tail(&lines, head);
+    } else {
+        list_splice(&lines, head);
+        if (n)
+            queue_of(head)->sorted = NULL;
+    }
+    *count = n;
+    return ok;
 }
@@ -17,12 +17,14 @@
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @lean: whether @value shares the block of the element
  *
- * @value needs to be explicitly allocated and freed
+ * @value needs to be explicitly allocated and freed, unless @lean is set
  */
 typedef struct {
     char *value;
     struct list_head list;
+    bool lean;
 } element_t;
 
 /**
@@ -35,7 +37,7 @@ typedef struct {
 typedef struct {
     struct list_head *q;
     struct list_head chain;
-    int size;
+    size_t size;
     int id;
 } queue_contex_t;
 
@@ -116,7 +118,8 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
+    if (!e->lean)
+        test_free(e->value);
     test_free(e);
 }
 
@@ -126,7 +129,7 @@ static inline void q_release_element(element_t *e)
  *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
-int q_size(struct list_head *head);
+size_t q_size(struct list_head *head);
 
 /**
  * q_delete_mid() - Delete the middle node in queue
@@ -200,6 +203,92 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/**
+ * q_sort_algo_t - Sorting algorithms available to q_sort()
+ * @Q_SORT_MERGE: bottom-up merge sort, the default
+ * @Q_SORT_TIMSORT: timsort, with binary-insertion minimum runs and galloping
+ *                  merges, which needs fewer comparisons on partially ordered
+ *                  input
+ */
+typedef enum {
+    Q_SORT_MERGE,
+    Q_SORT_TIMSORT,
+} q_sort_algo_t;
+
+/**
+ * q_sort_select() - Select the algorithm used by q_sort()
+ * @algo: sorting algorithm
+ * @count: whether to count comparisons, see q_sort_comparisons()
+ *
+ * Both algorithms are stable. Counting uses separately instantiated kernels,
+ * so it costs nothing when disabled.
+ */
+void q_sort_select(q_sort_algo_t algo, bool count);
+
+/**
+ * q_sort_memlimit() - Set the memory budget of q_sort()
+ * @bytes: budget in bytes, 0 for no limit
+ *
+ * A queue whose elements and strings take more than @bytes is sorted through
+ * temporary files: runs of about @bytes are sorted in memory, written out and
+ * freed, then merged back with a loser tree using large sequential reads.
+ * This needs allocation, unlike the in-memory sorts. A queue is sorted in
+ * memory when its external sort cannot start. If the final merge stops on a
+ * failure, the elements it did not reach are read back and sorted in memory.
+ * Allocations failing while they are read back are retried a bounded number
+ * of times in a row, so elements are lost only if a temporary file cannot be
+ * read or memory stays exhausted, and the queue then holds fewer elements.
+ */
+void q_sort_memlimit(size_t bytes);
+
+/**
+ * q_lean_layout() - Select how q_insert_head() and q_insert_tail() allocate
+ * @lean: store the string in the same block as its element
+ *
+ * The default layout allocates the element and a copy of the string
+ * separately. The lean layout makes a single allocation per element, which
+ * halves the allocator overhead on very large queues. Both layouts may be
+ * mixed within a queue; q_release_element() frees either.
+ */
+void q_lean_layout(bool lean);
+
+/**
+ * q_sort_comparisons() - Get the number of comparisons made by the last
+ * q_sort(), q_merge(), q_sort_topk() or merge cursor that ran with counting
+ * enabled
+ *
+ * Return: the number of string comparisons
+ */
+size_t q_sort_comparisons();
+
+/**
+ * q_sort_topk() - Sort only the first k elements of the queue
+ * @head: header of queue
+ * @k: number of elements to sort
+ * @descend: whether to select the largest elements in descending order
+ *
+ * Move the k smallest elements (largest, if @descend) to the front of the
+ * queue in the order q_sort() would put them, leaving the rest behind them in
+ * their original relative order. A bounded heap makes this O(n log k), and
+ * the sorted front is remembered so that a later q_sort() only sorts the
+ * rest. Sorts the whole queue if k is at least its size.
+ *
+ * Return: true for success, false if queue is NULL, k is 0 or allocation
+ * failed
+ */
+bool q_sort_topk(struct list_head *head, size_t k, bool descend);
+
+/**
+ * q_mark_unsorted() - Forget what is known about the order of the queue
+ * @head: header of queue
+ *
+ * Each queue tracks how far it is known to be sorted, so that q_sort() only
+ * has to sort elements added since the last sort and merge them in. The
+ * queue functions maintain this themselves; callers that rearrange elements
+ * with the list primitives directly must call this afterwards.
+ */
+void q_mark_unsorted(struct list_head *head);
+
 /**
  * q_ascend() - Remove every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -213,7 +302,7 @@ void q_sort(struct list_head *head, bool descend);
  *
  * Return: the number of elements in queue after performing operation
  */
-int q_ascend(struct list_head *head);
+size_t q_ascend(struct list_head *head);
 
 /**
  * q_descend() - Remove every node which has a node with a strictly greater
@@ -228,7 +317,7 @@ int q_ascend(struct list_head *head);
  *
  * Return: the number of elements in queue after performing operation
  */
-int q_descend(struct list_head *head);
+size_t q_descend(struct list_head *head);
 
 /**
  * q_merge() - Merge all the queues into one sorted queue, which is in
@@ -248,6 +337,252 @@ int q_descend(struct list_head *head);
  *
  * Return: the number of elements in queue after merging
  */
-int q_merge(struct list_head *head, bool descend);
+size_t q_merge(struct list_head *head, bool descend);
+
+/**
+ * qm_cursor_t - Read-only cursor over the merged order of a chain of queues
+ */
+typedef struct qm_cursor qm_cursor_t;
+
+/**
+ * qm_cursor_open() - Start streaming all queues of a chain in merged order
+ * @head: header of chain
+ * @descend: whether the queues are sorted in descending order
+ *
+ * The queues must be sorted and must not be modified while the cursor is
+ * open. Unlike q_merge(), nothing is relinked: a loser tree over the queues
+ * picks each next element with O(log k) comparisons for k queues. Equal
+ * elements are yielded in chain order, as q_merge() would arrange them.
+ *
+ * Return: the cursor, or NULL if the chain is NULL or empty or allocation
+ * failed
+ */
+qm_cursor_t *qm_cursor_open(struct list_head *head, bool descend);
+
+/**
+ * qm_cursor_next() - Advance a merge cursor
+ * @cur: cursor returned by qm_cursor_open()
+ *
+ * Return: the next element in merged order, NULL once all are consumed
+ */
+element_t *qm_cursor_next(qm_cursor_t *cur);
+
+/**
+ * qm_cursor_close() - Release a merge cursor, no effect if it is NULL
+ * @cur: cursor returned by qm_cursor_open()
+ */
+void qm_cursor_close(qm_cursor_t *cur);
+
+/**
+ * q_compact() - Move the elements of queue into memory in list order
+ * @head: header of queue
+ *
+ * Every element and its string is copied into a newly allocated block, in
+ * list order and before any old block is released, so that neighbours in the
+ * list end up close together in memory and traversals make sequential
+ * accesses again. The new blocks follow the layout chosen by q_lean_layout().
+ * Nodes are replaced, so pointers to elements of the queue become invalid.
+ *
+ * Return: true for success, false if queue is NULL or allocation failed, in
+ * which case the queue is left as it was
+ */
+bool q_compact(struct list_head *head);
+
+/**
+ * q_dup() - Create a snapshot of queue
+ * @head: header of queue
+ *
+ * The snapshot shares the elements of @head instead of copying them, and
+ * q_free() on either queue keeps them for the other. A snapshot of a snapshot
+ * shares with the same queue as the first one.
+ *
+ * While q_shared() holds, every operation that modifies either queue fails
+ * without touching it, as does q_save() of the snapshot, and a qm_cursor_t is
+ * the only way to read the snapshot's elements. q_unshare() gives the queues
+ * copies of their own first.
+ *
+ * Only taking the snapshot takes constant time. Every element embeds the node
+ * that links it into one list, so elements cannot be shared one by one, and
+ * unsharing copies all of them. A snapshot is cheaper than a copy only if it
+ * is freed, or its origin is, before that. A compressed queue is not shared:
+ * its front-coded strings are copied into the new queue instead.
+ *
+ * Return: the head of the snapshot, NULL if queue is NULL or allocation
+ * failed
+ */
+struct list_head *q_dup(struct list_head *head);
+
+/**
+ * q_unshare() - Stop sharing the elements of queue with other queues
+ * @head: header of queue
+ *
+ * A snapshot gets a copy of the elements it shares, and so does every
+ * snapshot of @head, after which they are independent queues. Order and the
+ * known sorted prefix are preserved. Copying needs allocation, so this should
+ * be called before an operation that disallows it.
+ *
+ * Return: true for success, false if queue is NULL or allocation failed, in
+ * which case the queues that were not copied yet go on sharing
+ */
+bool q_unshare(struct list_head *head);
+
+/**
+ * q_shared() - Whether queue shares its elements with other queues
+ * @head: header of queue
+ *
+ * Return: true if @head is a snapshot or has snapshots that were not unshared
+ */
+bool q_shared(struct list_head *head);
+
+/**
+ * q_compress() - Store the strings of a sorted queue front-coded
+ * @head: header of queue
+ * @block: number of strings per block, 0 for the default of 16
+ *
+ * The elements are released and their strings kept in a single block, where
+ * every @block-th string is stored whole and each other one as the length of
+ * the prefix it shares with the string before it plus the rest. Sorted keys
+ * share long prefixes, so this takes far less memory than an element per
+ * string. A compressed queue has no elements: it is read with a qc_cursor_t,
+ * q_free() releases it, and every other operation requires q_decompress()
+ * first. Compressing a compressed queue has no effect.
+ *
+ * Return: true for success, false if queue is NULL, not sorted as a whole,
+ * shared with a snapshot or allocation failed, in which case the queue is left
+ * as it was
+ */
+bool q_compress(struct list_head *head, size_t block);
+
+/**
+ * q_decompress() - Turn a compressed queue back into elements
+ * @head: header of queue
+ *
+ * New elements follow the layout chosen by q_lean_layout(), and the queue is
+ * known to be sorted in the order it had when it was compressed. A queue that
+ * is not compressed is left alone.
+ *
+ * Return: true for success, false if queue is NULL or allocation failed, in
+ * which case the queue stays compressed
+ */
+bool q_decompress(struct list_head *head);
+
+/**
+ * q_compressed() - Whether queue was compressed by q_compress()
+ * @head: header of queue
+ */
+bool q_compressed(struct list_head *head);
+
+/**
+ * qc_size() - Get the number of strings in a compressed queue
+ * @head: header of queue
+ *
+ * The count is kept with the front-coded strings, so nothing is decoded.
+ *
+ * Return: the number of strings, zero if queue is NULL or not compressed
+ */
+size_t qc_size(struct list_head *head);
+
+/**
+ * q_footprint() - Get the memory held by queue
+ * @head: header of queue
+ *
+ * Return: the bytes taken by the queue, its elements and strings, or by its
+ * compressed strings, without the overhead the allocator adds to each block
+ */
+size_t q_footprint(struct list_head *head);
+
+/**
+ * qc_cursor_t - Read-only cursor over the strings of a compressed queue
+ */
+typedef struct qc_cursor qc_cursor_t;
+
+/**
+ * qc_cursor_open() - Start decoding a compressed queue from its first string
+ * @head: header of queue
+ *
+ * The queue must not be decompressed or freed while the cursor is open.
+ *
+ * Return: the cursor, or NULL if queue is not compressed or allocation failed
+ */
+qc_cursor_t *qc_cursor_open(struct list_head *head);
+
+/**
+ * qc_cursor_next() - Decode the next string of a compressed queue
+ * @cur: cursor returned by qc_cursor_open()
+ *
+ * Each string is rebuilt from the one before it in a buffer of the cursor,
+ * so the returned string is only valid until the next call.
+ *
+ * Return: the next string in queue order, NULL once all are decoded
+ */
+const char *qc_cursor_next(qc_cursor_t *cur);
+
+/**
+ * qc_cursor_close() - Release a compressed queue cursor, no effect if NULL
+ * @cur: cursor returned by qc_cursor_open()
+ */
+void qc_cursor_close(qc_cursor_t *cur);
+
+/**
+ * q_save() - Write the elements of queue to a file
+ * @head: header of queue
+ * @path: file to create or overwrite
+ *
+ * The file holds a header, the strings in queue order, each preceded by its
+ * length, and a table with the offset of every string. The known sorted
+ * prefix is saved with them. A compressed queue is decoded string by string
+ * and saved as sorted. Files are read back by q_load() on hosts of the same
+ * byte order.
+ *
+ * Return: true for success, false if queue or @path is NULL, a string is 4 GiB
+ * or longer, or writing failed, in which case no file is left behind
+ */
+bool q_save(struct list_head *head, const char *path);
+
+/**
+ * q_load() - Append the elements saved in a file to queue
+ * @head: header of queue
+ * @path: file written by q_save()
+ *
+ * The file is mapped and validated as a whole before any element is built.
+ * Strings are copied straight out of the mapping with their saved lengths,
+ * into blocks laid out as chosen by q_lean_layout(). Loading into an empty
+ * queue restores its sorted prefix.
+ *
+ * Values are not left as views into the mapping. Elements outlive their queue
+ * once removed or merged elsewhere, so the mapping could not be unmapped with
+ * the queue.
+ *
+ * Return: true for success, false if queue or @path is NULL, the file is not
+ * a valid queue file or allocation failed, in which case the queue is left as
+ * it was
+ */
+bool q_load(struct list_head *head, const char *path);
+
+/**
+ * q_insert_file() - Insert every line of a text file
+ * @head: header of queue
+ * @path: file to read
+ * @tail: insert at tail, in file order, rather than at head, where the lines
+ *        end up in reverse order
+ * @count: set to the number of lines inserted
+ *
+ * The file is mapped and split at newlines; a final line without one is
+ * inserted as well. Each line is copied into an element laid out as chosen
+ * by q_lean_layout(), without the newline. Lines are inserted up to the first
+ * allocation that fails.
+ *
+ * Lines are never referenced in the mapping. q_release_element() frees every
+ * value that is not in the block of its element, and the element may by then
+ * have been moved to another queue or removed from all of them, so no queue
+ * could tell when the mapping is no longer used.
+ *
+ * Return: true for success, false if queue or @path is NULL, the file could
+ * not be read or allocation failed
+ */
+bool q_insert_file(struct list_head *head,
+                   const char *path,
+                   bool tail,
+                   size_t *count);
 
 #endif /* LAB0_QUEUE_H */
@@ -0,0 +1,813 @@
+/* Template of queue kernels specialized at compile time
+ *
+ * Define the following before including this file:
+ *   QT_NAME       name fragment of the generated functions, e.g. ascend
+ *   QT_DESCEND    1 to order elements in descending order, 0 for ascending
+ * and optionally:
+ *   QT_CMP(a, b)  three-way comparison of two element_t pointers, defaults to
+ *                 strcmp() of their values
+ *   QT_COUNTER    lvalue incremented once per comparison
+ *
+ * For lists of element_t linked through their list member, it generates
+ *   qt_<name>_merge()        merge two null-terminated sorted runs
+ *   qt_<name>_merge_final()  merge two runs and rebuild the circular list
+ *   qt_<name>_sort()         stable bottom-up merge sort
+ *   qt_<name>_timsort()      stable natural merge sort with minimum run
+ *                            length and galloping merges
+ *   qt_<name>_merge_prefix() merge a sorted list into a sorted queue
+ *   qt_<name>_topk()         move the first k elements in order to the front
+ *   qt_<name>_loser_build()  build a loser tree over k sorted queues
+ *   qt_<name>_loser_next()   yield the next node of the merged order
+ *   qt_<name>_dedup()        delete every element equal to an adjacent one
+ *   qt_<name>_monotone()     delete every element followed anywhere by a
+ *                            strictly smaller one (larger, if descending)
+ *
+ * The comparator is expanded in place and the direction is a compile-time
+ * constant, so no kernel makes indirect calls or tests the direction in its
+ * inner loop. This file has no include guard: include it once per
+ * instantiation. All parameters are undefined again at the end.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "list.h"
+#include "queue.h"
+
+#ifndef QT_NAME
+#error "QT_NAME must be defined before including queue_template.h"
+#endif
+
+#ifndef QT_DESCEND
+#error "QT_DESCEND must be defined before including queue_template.h"
+#endif
+
+#ifndef QT_CMP
+#define QT_CMP(a, b) strcmp((a)->value, (b)->value)
+#endif
+
+#ifdef QT_COUNTER
+#define __QT_COUNT() ((void) (QT_COUNTER++))
+#else
+#define __QT_COUNT() ((void) 0)
+#endif
+
+#define __QT_CAT(a, b) a##b
+#define __QT_XCAT(a, b) __QT_CAT(a, b)
+#define __QT_FN(fn) __QT_XCAT(__QT_XCAT(qt_, QT_NAME), _##fn)
+
+/* Whether @a may precede @b in the output. Equal elements keep their order,
+ * which is what makes the sorts stable.
+ */
+static inline bool __QT_FN(before)(struct list_head *a, struct list_head *b)
+{
+    __QT_COUNT();
+    int res = QT_CMP(list_entry(a, element_t, list),
+                     list_entry(b, element_t, list));
+#if QT_DESCEND
+    return res >= 0;
+#else
+    return res <= 0;
+#endif
+}
+
+static inline bool __QT_FN(equal)(struct list_head *a, struct list_head *b)
+{
+    __QT_COUNT();
+    return QT_CMP(list_entry(a, element_t, list),
+                  list_entry(b, element_t, list)) == 0;
+}
+
+/*
+ * Returns a list organized in an intermediate format suited
+ * to chaining of merge() calls: null-terminated, no reserved or
+ * sentinel head node, "prev" links not maintained.
+ */
+static inline struct list_head *__QT_FN(merge)(struct list_head *a,
+                                               struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
+
+    for (;;) {
+        /* if equal, take 'a' -- important for sort stability */
+        if (__QT_FN(before)(a, b)) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+    return head;
+}
+
+/* Link the null-terminated @list after @tail, restoring prev links, and close
+ * the circle at @head.
+ */
+static inline void __QT_FN(build_prev_link)(struct list_head *head,
+                                            struct list_head *tail,
+                                            struct list_head *list)
+{
+    tail->next = list;
+    do {
+        list->prev = tail;
+        tail = list;
+        list = list->next;
+    } while (list);
+
+    /* The final links to make a circular doubly-linked list */
+    tail->next = head;
+    head->prev = tail;
+}
+
+/*
+ * Combine final list merge with restoration of standard doubly-linked
+ * list structure.  This approach duplicates code from merge(), but
+ * runs faster than the tidier alternatives of either a separate final
+ * prev-link restoration pass, or maintaining the prev links
+ * throughout.
+ */
+static inline void __QT_FN(merge_final)(struct list_head *head,
+                                        struct list_head *a,
+                                        struct list_head *b)
+{
+    struct list_head *tail = head;
+
+    for (;;) {
+        /* if equal, take 'a' -- important for sort stability */
+        if (__QT_FN(before)(a, b)) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+            if (!a)
+                break;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+            if (!b) {
+                b = a;
+                break;
+            }
+        }
+    }
+
+    /* Finish linking remainder of list b on to tail */
+    __QT_FN(build_prev_link)(head, tail, b);
+}
+
+/*
+ * Bottom-up merge sort of Linux list_sort(): as eager as possible while
+ * always performing at least 2:1 balanced merges. "count" is the number of
+ * pending elements; each time it is incremented and bit k flips to 1 with
+ * non-zero higher bits, two pending sublists of size 2^k are merged. See
+ * lib/list_sort.c for the full derivation.
+ */
+static inline void __QT_FN(sort)(struct list_head *head)
+{
+    struct list_head *list = head->next, *pending = NULL;
+    size_t count = 0; /* Count of pending */
+
+    if (list == head->prev) /* Zero or one elements */
+        return;
+
+    /* Convert to a null-terminated singly-linked list. */
+    head->prev->next = NULL;
+
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Do the indicated merge */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+
+            a = __QT_FN(merge)(b, a);
+            /* Install the merged result in place of the inputs */
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        /* Move one element from input list to pending */
+        list->prev = pending;
+        pending = list;
+        list = list->next;
+        pending->next = NULL;
+        count++;
+    } while (list);
+
+    /* End of input; merge together all the pending lists. */
+    list = pending;
+    pending = pending->prev;
+    for (;;) {
+        struct list_head *next = pending->prev;
+
+        if (!next)
+            break;
+        list = __QT_FN(merge)(pending, list);
+        pending = next;
+    }
+    /* The final merge, rebuilding prev links */
+    __QT_FN(merge_final)(head, pending, list);
+}
+
+#ifndef QT_TIMSORT_DEFINED
+#define QT_TIMSORT_DEFINED
+/* Galloping mode is entered after this many consecutive wins of one run */
+#define QT_MIN_GALLOP 7
+
+/* Upper bound of the minimum run length */
+#define QT_MAX_MINRUN 64
+
+/* Bookkeeping shared by the timsort helpers */
+typedef struct {
+    size_t stk_size;   /* Number of runs on the stack */
+    size_t min_gallop; /* Adaptive threshold for galloping mode */
+} qt_timsort_t;
+
+/* Minimum run length for @n elements: between QT_MAX_MINRUN / 2 and
+ * QT_MAX_MINRUN, chosen so that n / minrun is a power of two or slightly
+ * less than one, which keeps the final merges balanced.
+ */
+static inline size_t qt_minrun(size_t n)
+{
+    size_t r = 0;
+    while (n >= QT_MAX_MINRUN) {
+        r |= n & 1;
+        n >>= 1;
+    }
+    return n + r;
+}
+#endif
+
+/* Timsort keeps the length of each run in the prev pointer of its second
+ * node, and chains the runs on its stack through the prev pointer of their
+ * first node.
+ */
+static inline size_t __QT_FN(run_size)(struct list_head *head)
+{
+    if (!head)
+        return 0;
+    if (!head->next)
+        return 1;
+    return (size_t) (head->next->prev);
+}
+
+/* Whether @node goes before @key when merging. Nodes of the earlier run go
+ * before an equal @key, nodes of the later run (@strict) do not.
+ */
+static inline bool __QT_FN(goes_before)(struct list_head *node,
+                                        struct list_head *key,
+                                        bool strict)
+{
+    return strict ? !__QT_FN(before)(key, node) : __QT_FN(before)(node, key);
+}
+
+/* Count the leading nodes of the null-terminated sorted @run that go before
+ * @key, storing the last of them in @last. Probes offsets 0, 1, 3, 7, ... and
+ * then binary-searches the last interval, so a result of k costs O(log k)
+ * comparisons (but still O(k) steps along the list).
+ */
+static inline size_t __QT_FN(gallop)(struct list_head *run,
+                                     struct list_head *key,
+                                     bool strict,
+                                     struct list_head **last)
+{
+    struct list_head *node = run, *lo_node = NULL;
+    size_t lo = 0, hi, pos = 0, step = 1;
+
+    /* Exponential search: indices below lo qualify, index hi does not */
+    for (;;) {
+        if (!__QT_FN(goes_before)(node, key, strict)) {
+            hi = pos;
+            break;
+        }
+        lo = pos + 1;
+        lo_node = node;
+        if (!node->next) {
+            hi = lo;
+            break;
+        }
+        size_t i;
+        for (i = 0; i < step && node->next; i++)
+            node = node->next;
+        pos += i;
+        step <<= 1;
+    }
+
+    /* Binary search of the indices between lo and hi */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        node = lo_node ? lo_node->next : run;
+        for (size_t i = lo; i < mid; i++)
+            node = node->next;
+        if (__QT_FN(goes_before)(node, key, strict)) {
+            lo = mid + 1;
+            lo_node = node;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *last = lo_node;
+    return lo;
+}
+
+/* Merge two null-terminated runs, @a preceding @b in the input. Once one run
+ * has won ts->min_gallop comparisons in a row, whole stretches of each run
+ * are located by galloping instead. The threshold drops while galloping pays
+ * off and rises when it does not.
+ */
+static inline struct list_head *__QT_FN(gallop_merge)(struct list_head *a,
+                                                      struct list_head *b,
+                                                      qt_timsort_t *ts)
+{
+    struct list_head *head = NULL, **tail = &head, *last;
+    size_t wins_a = 0, wins_b = 0;
+
+    for (;;) {
+        if (wins_a >= ts->min_gallop || wins_b >= ts->min_gallop) {
+            size_t na = __QT_FN(gallop)(a, b, false, &last);
+            if (na) {
+                *tail = a;
+                tail = &last->next;
+                a = last->next;
+                if (!a) {
+                    *tail = b;
+                    break;
+                }
+            }
+            size_t nb = __QT_FN(gallop)(b, a, true, &last);
+            if (nb) {
+                *tail = b;
+                tail = &last->next;
+                b = last->next;
+                if (!b) {
+                    *tail = a;
+                    break;
+                }
+            }
+            if (na < QT_MIN_GALLOP && nb < QT_MIN_GALLOP) {
+                /* Leave galloping mode, and make it harder to re-enter */
+                ts->min_gallop++;
+                wins_a = wins_b = 0;
+            } else if (ts->min_gallop > 1) {
+                ts->min_gallop--;
+            }
+            continue;
+        }
+
+        /* if equal, take 'a' -- important for sort stability */
+        if (__QT_FN(before)(a, b)) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+            wins_a++;
+            wins_b = 0;
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+            wins_b++;
+            wins_a = 0;
+        }
+    }
+    return head;
+}
+
+/* Detach the natural run starting at @list, reversing it if it is strictly
+ * descending. Stores its length in @len and the rest of the input in @rest.
+ */
+static inline struct list_head *__QT_FN(find_run)(struct list_head *list,
+                                                  size_t *len,
+                                                  struct list_head **rest)
+{
+    struct list_head *next = list->next, *head = list;
+
+    *len = 1;
+    if (!next) {
+        *rest = NULL;
+        return head;
+    }
+
+    if (!__QT_FN(before)(list, next)) {
+        /* strictly decreasing run, also reverse the list */
+        struct list_head *prev = NULL;
+        do {
+            (*len)++;
+            list->next = prev;
+            prev = list;
+            list = next;
+            next = list->next;
+            head = list;
+        } while (next && !__QT_FN(before)(list, next));
+        list->next = prev;
+    } else {
+        do {
+            (*len)++;
+            list = next;
+            next = list->next;
+        } while (next && __QT_FN(before)(list, next));
+        list->next = NULL;
+    }
+    *rest = next;
+    return head;
+}
+
+/* Grow the run @run of length @len to @minrun nodes by binary insertion of
+ * the nodes taken from @rest. Each node is inserted after all nodes equal to
+ * it, which keeps the sort stable.
+ */
+static inline struct list_head *__QT_FN(extend_run)(struct list_head *run,
+                                                    size_t *len,
+                                                    size_t minrun,
+                                                    struct list_head **rest)
+{
+    struct list_head *buf[QT_MAX_MINRUN];
+    size_t n = 0;
+
+    for (struct list_head *node = run; node; node = node->next)
+        buf[n++] = node;
+
+    while (n < minrun && *rest) {
+        struct list_head *x = *rest;
+        size_t lo = 0, hi = n;
+
+        *rest = x->next;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (__QT_FN(before)(buf[mid], x))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        memmove(&buf[lo + 1], &buf[lo], (n - lo) * sizeof(buf[0]));
+        buf[lo] = x;
+        n++;
+    }
+
+    for (size_t i = 0; i + 1 < n; i++)
+        buf[i]->next = buf[i + 1];
+    buf[n - 1]->next = NULL;
+    *len = n;
+    return buf[0];
+}
+
+static inline struct list_head *__QT_FN(merge_at)(struct list_head *at,
+                                                  qt_timsort_t *ts)
+{
+    size_t len = __QT_FN(run_size)(at) + __QT_FN(run_size)(at->prev);
+    struct list_head *prev = at->prev->prev;
+    struct list_head *list = __QT_FN(gallop_merge)(at->prev, at, ts);
+    list->prev = prev;
+    list->next->prev = (struct list_head *) len;
+    --ts->stk_size;
+    return list;
+}
+
+static inline struct list_head *__QT_FN(merge_force_collapse)(
+    struct list_head *tp,
+    qt_timsort_t *ts)
+{
+    while (ts->stk_size >= 3) {
+        if (__QT_FN(run_size)(tp->prev->prev) < __QT_FN(run_size)(tp)) {
+            tp->prev = __QT_FN(merge_at)(tp->prev, ts);
+        } else {
+            tp = __QT_FN(merge_at)(tp, ts);
+        }
+    }
+    return tp;
+}
+
+static inline struct list_head *__QT_FN(merge_collapse)(struct list_head *tp,
+                                                        qt_timsort_t *ts)
+{
+    size_t n;
+    while ((n = ts->stk_size) >= 2) {
+        if ((n >= 3 && __QT_FN(run_size)(tp->prev->prev) <=
+                           __QT_FN(run_size)(tp->prev) +
+                               __QT_FN(run_size)(tp)) ||
+            (n >= 4 && __QT_FN(run_size)(tp->prev->prev->prev) <=
+                           __QT_FN(run_size)(tp->prev->prev) +
+                               __QT_FN(run_size)(tp->prev))) {
+            if (__QT_FN(run_size)(tp->prev->prev) < __QT_FN(run_size)(tp)) {
+                tp->prev = __QT_FN(merge_at)(tp->prev, ts);
+            } else {
+                tp = __QT_FN(merge_at)(tp, ts);
+            }
+        } else if (__QT_FN(run_size)(tp->prev) <= __QT_FN(run_size)(tp)) {
+            tp = __QT_FN(merge_at)(tp, ts);
+        } else {
+            break;
+        }
+    }
+
+    return tp;
+}
+
+/* Stable natural merge sort: runs shorter than the minimum run length are
+ * extended by binary insertion, and merges switch to galloping when one run
+ * keeps winning.
+ */
+static inline void __QT_FN(timsort)(struct list_head *head)
+{
+    qt_timsort_t ts = {.stk_size = 0, .min_gallop = QT_MIN_GALLOP};
+    struct list_head *list = head->next, *tp = NULL, *node;
+    size_t n = 0;
+
+    if (head == head->prev)
+        return;
+
+    list_for_each (node, head)
+        n++;
+    size_t minrun = qt_minrun(n);
+
+    /* Convert to a null-terminated singly-linked list. */
+    head->prev->next = NULL;
+
+    do {
+        /* Find next run, and extend it to minrun if it is short */
+        size_t len;
+        struct list_head *run = __QT_FN(find_run)(list, &len, &list);
+        if (len < minrun && list)
+            run = __QT_FN(extend_run)(run, &len, minrun, &list);
+        run->prev = tp;
+        if (len > 1)
+            run->next->prev = (struct list_head *) len;
+        tp = run;
+        ts.stk_size++;
+        tp = __QT_FN(merge_collapse)(tp, &ts);
+    } while (list);
+
+    /* End of input; merge together all the runs. */
+    tp = __QT_FN(merge_force_collapse)(tp, &ts);
+
+    /* The final merge; rebuild prev links */
+    struct list_head *stk0 = tp, *stk1 = stk0->prev;
+    while (stk1 && stk1->prev)
+        stk0 = stk0->prev, stk1 = stk1->prev;
+    if (ts.stk_size > 1)
+        stk0 = __QT_FN(gallop_merge)(stk1, stk0, &ts);
+    __QT_FN(build_prev_link)(head, head, stk0);
+}
+
+/* Merge the sorted list @prefix into the sorted list @head, leaving @prefix
+ * empty. Elements of @prefix came first in the input and go first among
+ * equals. Merging gallops, so when one list is much shorter than the other
+ * the number of comparisons stays close to the length of the shorter one,
+ * although every node is still visited once.
+ */
+static inline void __QT_FN(merge_prefix)(struct list_head *head,
+                                         struct list_head *prefix)
+{
+    qt_timsort_t ts = {.stk_size = 0, .min_gallop = QT_MIN_GALLOP};
+
+    if (list_empty(prefix))
+        return;
+    if (list_empty(head)) {
+        list_splice_init(prefix, head);
+        return;
+    }
+
+    /* Convert both to null-terminated singly-linked lists */
+    struct list_head *a = prefix->next, *b = head->next;
+    prefix->prev->next = NULL;
+    head->prev->next = NULL;
+    INIT_LIST_HEAD(prefix);
+
+    __QT_FN(build_prev_link)(head, head, __QT_FN(gallop_merge)(a, b, &ts));
+}
+
+#ifndef QT_TOPK_DEFINED
+#define QT_TOPK_DEFINED
+/* Heap entry of the top-k selection: a node and its position in the queue */
+typedef struct {
+    struct list_head *node;
+    size_t pos;
+} qt_rank_t;
+#endif
+
+/* Whether @a goes before @b in the output, equal elements by position */
+static inline bool __QT_FN(ranks_before)(const qt_rank_t *a,
+                                         const qt_rank_t *b)
+{
+    return a->pos < b->pos ? __QT_FN(before)(a->node, b->node)
+                           : !__QT_FN(before)(b->node, a->node);
+}
+
+/* Restore the heap property below @i of the @n entries of @heap, whose root
+ * is the entry that goes last in the output
+ */
+static inline void __QT_FN(sift_down)(qt_rank_t *heap, size_t n, size_t i)
+{
+    qt_rank_t x = heap[i];
+
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && __QT_FN(ranks_before)(&heap[c], &heap[c + 1]))
+            c++;
+        if (!__QT_FN(ranks_before)(&x, &heap[c]))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = x;
+}
+
+/* Move the first @k elements of the output, 0 < @k <= the queue length, to
+ * the front of the queue in order, using @heap of @k entries as scratch. The
+ * other elements keep their relative order. Takes O(n log k) comparisons.
+ */
+static inline void __QT_FN(topk)(struct list_head *head,
+                                 qt_rank_t *heap,
+                                 size_t k)
+{
+    struct list_head *node;
+    size_t pos = 0;
+
+    list_for_each (node, head) {
+        qt_rank_t x = {.node = node, .pos = pos++};
+        if (pos < k) {
+            heap[pos - 1] = x;
+        } else if (pos == k) {
+            heap[k - 1] = x;
+            for (size_t i = k / 2; i-- > 0;)
+                __QT_FN(sift_down)(heap, k, i);
+        } else if (__QT_FN(ranks_before)(&x, &heap[0])) {
+            heap[0] = x;
+            __QT_FN(sift_down)(heap, k, 0);
+        }
+    }
+
+    /* Heap sort the winners, then move them to the front */
+    for (size_t end = k - 1; end > 0; end--) {
+        qt_rank_t x = heap[0];
+        heap[0] = heap[end];
+        heap[end] = x;
+        __QT_FN(sift_down)(heap, end, 0);
+    }
+    for (size_t i = k; i-- > 0;)
+        list_move(heap[i].node, head);
+}
+
+#ifndef QT_LOSER_TREE_DEFINED
+#define QT_LOSER_TREE_DEFINED
+/* Leaf of a loser tree: the next node of one sorted queue, NULL once the
+ * queue is exhausted
+ */
+typedef struct {
+    struct list_head *pos;
+    struct list_head *head;
+} qt_leaf_t;
+#endif
+
+/* Whether leaf @a beats leaf @b of the @k leaves. Index @k is a sentinel that
+ * beats everything, used while the tree is built. Exhausted leaves lose, and
+ * equal elements are taken from the earlier queue first.
+ */
+static inline bool __QT_FN(leaf_beats)(const qt_leaf_t *leaf,
+                                       size_t k,
+                                       size_t a,
+                                       size_t b)
+{
+    if (a == k)
+        return true;
+    if (b == k || !leaf[a].pos)
+        return false;
+    if (!leaf[b].pos)
+        return true;
+    return a < b ? __QT_FN(before)(leaf[a].pos, leaf[b].pos)
+                 : !__QT_FN(before)(leaf[b].pos, leaf[a].pos);
+}
+
+/* Replay the matches from leaf @s up to the root of the loser tree @tree,
+ * whose internal nodes 1..k-1 hold the loser of each match and whose entry 0
+ * holds the overall winner. Takes O(log k) comparisons.
+ */
+static inline void __QT_FN(loser_adjust)(size_t *tree,
+                                         const qt_leaf_t *leaf,
+                                         size_t k,
+                                         size_t s)
+{
+    size_t winner = s;
+
+    for (size_t t = (s + k) / 2; t > 0; t /= 2) {
+        if (__QT_FN(leaf_beats)(leaf, k, tree[t], winner)) {
+            size_t loser = winner;
+            winner = tree[t];
+            tree[t] = loser;
+        }
+    }
+    tree[0] = winner;
+}
+
+/* Build the loser tree of @k leaves */
+static inline void __QT_FN(loser_build)(size_t *tree,
+                                        const qt_leaf_t *leaf,
+                                        size_t k)
+{
+    for (size_t i = 0; i < k; i++)
+        tree[i] = k;
+    for (size_t i = k; i-- > 0;)
+        __QT_FN(loser_adjust)(tree, leaf, k, i);
+}
+
+/* Yield the next node in merged order and advance its leaf, or NULL once all
+ * leaves are exhausted
+ */
+static inline struct list_head *__QT_FN(loser_next)(size_t *tree,
+                                                    qt_leaf_t *leaf,
+                                                    size_t k)
+{
+    size_t w = tree[0];
+    struct list_head *node = leaf[w].pos;
+
+    if (!node)
+        return NULL;
+
+    leaf[w].pos = node->next != leaf[w].head ? node->next : NULL;
+    __QT_FN(loser_adjust)(tree, leaf, k, w);
+    return node;
+}
+
+/* Delete every element whose value equals that of a neighbor */
+static inline void __QT_FN(dedup)(struct list_head *head)
+{
+    struct list_head *node = head->next;
+
+    while (node != head) {
+        struct list_head *next = node->next;
+        bool dup = false;
+
+        while (next != head && __QT_FN(equal)(node, next)) {
+            list_del(next);
+            q_release_element(list_entry(next, element_t, list));
+            next = node->next;
+            dup = true;
+        }
+        if (dup) {
+            list_del(node);
+            q_release_element(list_entry(node, element_t, list));
+        }
+        node = next;
+    }
+}
+
+/* Scan from the tail, keeping an element only if it may precede the last
+ * element kept, which is the extreme of everything to its right.
+ *
+ * Return: the number of elements left
+ */
+static inline size_t __QT_FN(monotone)(struct list_head *head)
+{
+    struct list_head *keep = head->prev, *node;
+    size_t n = 1;
+
+    for (node = keep->prev; node != head;) {
+        struct list_head *prev = node->prev;
+
+        if (__QT_FN(before)(node, keep)) {
+            keep = node;
+            n++;
+        } else {
+            list_del(node);
+            q_release_element(list_entry(node, element_t, list));
+        }
+        node = prev;
+    }
+    return n;
+}
+
+#undef __QT_FN
+#undef __QT_XCAT
+#undef __QT_CAT
+#undef __QT_COUNT
+#undef QT_NAME
+#undef QT_DESCEND
+#undef QT_CMP
+#undef QT_COUNTER
@@ -4,6 +4,7 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import time
 
 
 
@@ -17,6 +18,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    timed = False
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +37,25 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-timsort",
+        19: "trace-19-incremental",
+        20: "trace-20-topk",
+        21: "trace-21-mergeview",
+        22: "trace-22-external",
+        23: "trace-23-compact",
+        24: "trace-24-asyncfree",
+        25: "trace-25-dup",
+        26: "trace-26-saveload",
+        27: "trace-27-file",
+        28: "trace-28-compress",
+        29: "trace-29-guard",
+        30: "trace-30-heapprof",
+        31: "trace-31-profile",
+        32: "trace-32-perf",
+        33: "trace-33-hist",
+        34: "trace-34-external-fail",
+        35: "trace-35-lean"
     }
 
     traceProbs = {
@@ -55,10 +75,33 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25",
+        26: "Trace-26",
+        27: "Trace-27",
+        28: "Trace-28",
+        29: "Trace-29",
+        30: "Trace-30",
+        31: "Trace-31",
+        32: "Trace-32",
+        33: "Trace-33",
+        34: "Trace-34",
+        35: "Trace-35"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces that check the queue through the harness, by making its
+    # allocations fail or by guarding and profiling its blocks. A queue built
+    # against the C library allocator passes them without being checked.
+    harnessTraces = [11, 12, 13, 20, 23, 24, 26, 27, 28, 29, 30, 34]
+
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,13 +112,17 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 timed=False,
+                 checked=True):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.timed = timed
+        self.checked = checked
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -109,28 +156,35 @@ class Tracer:
             tidList = [tid]
         score = 0
         maxscore = 0
+        elapsed = 0.0
         if self.useValgrind:
             self.command = ['valgrind', self.qtest]
         else:
             self.command = [self.qtest]
         for t in tidList:
             tname = self.traceDict[t]
+            if not self.checked and t in self.harnessTraces:
+                self.printInColor("---\t%s\tskipped" % tname, self.WHITE)
+                continue
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
+            start = time.time()
             ok = self.runTrace(t)
+            took = time.time() - start
+            elapsed += took
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
-            if tval < maxval:
-                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
-            else:
-                self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
+            line = "---\t%s\t%d/%d" % (tname, tval, maxval)
+            if self.timed:
+                line += "\t%.3fs" % took
+            self.printInColor(line, self.RED if tval < maxval else self.GREEN)
             score += tval
             maxscore += maxval
             scoreDict[t] = tval
-        if score < maxscore:
-            self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
-        else:
-            self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
+        line = "---\tTOTAL\t\t%d/%d" % (score, maxscore)
+        if self.timed:
+            line += "\t%.3fs" % elapsed
+        self.printInColor(line, self.RED if score < maxscore else self.GREEN)
         if self.autograde:
             # Generate JSON string
             jstring = '{"scores": {'
@@ -146,12 +200,15 @@ class Tracer:
             sys.exit(1)
 
 def usage(name):
-    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [--fast] [-c]" % name)
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  --fast    Test qtest-fast (real allocator, no leak checks),")
+    print("            skip the traces it cannot fail and report the time")
+    print("            each trace takes")
     sys.exit(0)
 
 
@@ -163,8 +220,9 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    fast = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind', 'fast'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -179,6 +237,8 @@ def run(name, args):
             autograde = True
         elif opt == '--valgrind':
             useValgrind = True
+        elif opt == '--fast':
+            fast = True
         elif opt == '-c':
             colored = True
         else:
@@ -186,11 +246,15 @@ def run(name, args):
             usage(name)
     if not levelFixed and autograde:
         vlevel = 0
+    if fast and prog == "":
+        prog = "./qtest-fast"
     t = Tracer(qtest=prog,
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               timed=fast,
+               checked=not fast)
     t.run(tid)
 
 
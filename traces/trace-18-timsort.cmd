@@ -0,0 +1,29 @@
+# Test of timsort and sort with timsort selected as the algorithm
+option fail 0
+option malloc 0
+new
+it dolphin
+it bear
+it gerbil
+it bear
+it meerkat
+timsort
+rh bear
+rh bear
+rh dolphin
+option sortalgo 1
+ih zebra
+ih yak
+it aardvark
+sort
+rh aardvark
+rh gerbil
+rh meerkat
+rh yak
+rh zebra
+it RAND 1000
+reverse
+sort
+descend
+free
+option sortalgo 0
@@ -0,0 +1,39 @@
+# Test of sorting a sorted queue again after other operations
+option fail 0
+option malloc 0
+new
+it gerbil
+it bear
+it meerkat
+it dolphin
+sort
+it aardvark
+it zebra
+ih yak
+rt zebra
+sort
+reverse
+it bear
+option descend 1
+sort
+rh yak
+rh meerkat
+rh gerbil
+rh dolphin
+rh bear
+rh bear
+rh aardvark
+it RAND 100
+sort
+it RAND 20
+ih zzzz
+dedup
+option descend 0
+sort
+new
+it cat
+it ant
+it cow
+sort
+merge
+free
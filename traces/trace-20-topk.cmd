@@ -0,0 +1,33 @@
+# Test of partially sorting the first k elements
+option fail 0
+option malloc 0
+new
+it gerbil
+it bear
+it meerkat
+it dolphin
+it aardvark
+it zebra
+it bear
+topk 3
+rh aardvark
+rh bear
+rh bear
+option descend 1
+topk 2
+rh zebra
+rh meerkat
+it RAND 500
+topk 10
+sort
+option descend 0
+it RAND 500
+topk 1
+option fail 10
+option malloc 50
+topk 20
+topk 20
+topk 20
+option malloc 0
+topk 2000
+free
@@ -0,0 +1,35 @@
+# Test of scanning several queues in merged order without merging them
+option fail 0
+option malloc 0
+new
+it bear
+it gerbil
+it zebra
+new
+it aardvark
+it dolphin
+it meerkat
+new
+new
+it bear
+it cat
+it yak
+mergeview
+mergeview 4
+it RAND 100
+sort
+prev
+it RAND 100
+sort
+mergeview 50
+option descend 1
+sort
+prev
+sort
+prev
+sort
+prev
+sort
+mergeview
+merge
+free
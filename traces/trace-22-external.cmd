@@ -0,0 +1,29 @@
+# Test of sorting and merging through temporary files under a memory budget
+option fail 0
+option malloc 0
+option sortmem 1
+new
+it gerbil
+it bear
+it meerkat
+it dolphin
+it bear
+sort
+rh bear
+rh bear
+rh dolphin
+it RAND 3000
+sort
+option descend 1
+it RAND 1000
+sort
+option sortalgo 1
+reverse
+sort
+new
+it RAND 2000
+sort
+merge
+option sortmem 0
+option sortalgo 0
+free
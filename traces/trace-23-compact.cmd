@@ -0,0 +1,40 @@
+# Test of reallocating the nodes of a queue in list order
+option fail 0
+option malloc 0
+new
+compact
+it gerbil
+it bear
+ih meerkat
+it dolphin
+compact
+sort
+it zebra
+compact
+it aardvark
+sort
+rh aardvark
+rh bear
+rh dolphin
+option lean 1
+it RAND 1000
+sort
+compact
+dedup
+option lean 0
+ih RAND 100
+trim
+compact
+rt
+sort
+option fail 10
+option malloc 20
+compact
+compact
+compact
+option malloc 0
+option fail 0
+reverse
+compact
+rh
+free
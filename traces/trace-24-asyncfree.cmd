@@ -0,0 +1,39 @@
+# Test of freeing queues on a background thread while others are in use
+option fail 0
+option malloc 0
+option asyncfree 1
+new
+it RAND 20000
+new
+it RAND 1000
+sort
+prev
+free
+it bear
+it aardvark
+sort
+reverse
+new
+it RAND 20000
+option lean 1
+new
+ih RAND 500
+free
+free
+sort
+new
+new
+option fail 30
+option malloc 10
+it RAND 30
+prev
+ih dolphin
+free
+option malloc 0
+option asyncfree 0
+new
+it gerbil
+free
+option asyncfree 1
+free
+free
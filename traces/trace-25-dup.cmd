@@ -0,0 +1,47 @@
+# Test of snapshots sharing elements until either queue is modified
+option fail 0
+option malloc 0
+new
+it dolphin
+it bear
+it gerbil
+sort
+dup
+dup
+dedup
+rh bear
+it zebra
+next
+rh bear
+rh dolphin
+next
+rh bear
+reverse
+rh gerbil
+next
+dup
+free
+it RAND 200
+sort
+dup
+new
+ih meerkat
+dup
+free
+mergeview
+merge
+free
+new
+it RAND 100
+dup
+prev
+free
+rh
+new
+it cat
+dup
+option asyncfree 1
+free
+free
+option asyncfree 0
+free
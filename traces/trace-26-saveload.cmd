@@ -0,0 +1,44 @@
+# Test of saving queues to binary files and loading them back
+option fail 0
+option malloc 0
+new
+save /tmp/lab0-trace-26-empty.bin
+it gerbil
+it bear
+ih meerkat
+save /tmp/lab0-trace-26-small.bin
+it RAND 500
+sort
+save /tmp/lab0-trace-26-sorted.bin
+new
+load /tmp/lab0-trace-26-small.bin
+load /tmp/lab0-trace-26-empty.bin
+rh meerkat
+rh gerbil
+rh bear
+load /tmp/lab0-trace-26-sorted.bin
+it aardvark
+sort
+option lean 1
+new
+load /tmp/lab0-trace-26-sorted.bin
+load /tmp/lab0-trace-26-small.bin
+option descend 1
+sort
+option descend 0
+option lean 0
+dup
+load /tmp/lab0-trace-26-small.bin
+reverse
+sort
+new
+option fail 10
+option malloc 5
+load /tmp/lab0-trace-26-sorted.bin
+load /tmp/lab0-trace-26-sorted.bin
+option malloc 0
+free
+free
+free
+free
+free
@@ -0,0 +1,28 @@
+# Test of inserting the lines of text files
+option fail 0
+option malloc 0
+new
+it FILE traces/trace-01-ops.cmd
+ih FILE traces/trace-01-ops.cmd
+sort
+it FILE LICENSE
+option lean 1
+ih FILE LICENSE
+reverse
+sort
+dedup
+it FILE LICENSE
+rh
+sort
+new
+new
+option fail 10
+option malloc 5
+it FILE LICENSE
+option malloc 0
+sort
+prev
+it FILE LICENSE
+sort
+merge
+free
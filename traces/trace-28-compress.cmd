@@ -0,0 +1,42 @@
+# Test of front-coded compression of sorted queues
+option fail 0
+option malloc 0
+new
+it FILE LICENSE
+it FILE traces/trace-01-ops.cmd
+sort
+compress
+size
+save /tmp/lab0-trace-28.bin
+it zebra
+compress 3
+dup
+mergeview
+compress
+decompress
+rt zebra
+new
+it RAND 1000
+sort
+compress 1
+next
+reverse
+compress 8
+sort
+prev
+merge
+compress
+size
+dup
+size
+new
+load /tmp/lab0-trace-28.bin
+sort
+prev
+compress
+option fail 10
+option malloc 10
+decompress
+compress
+option malloc 0
+free
@@ -0,0 +1,28 @@
+# Test of operations with sampled poisoning and guard pages
+option fail 0
+option malloc 0
+option guard 1
+new
+ih dolphin
+it gerbil
+ih bear 3
+it RAND 20
+rh bear
+reverse
+sort
+rt
+dedup
+option poison 0
+option guard 5
+new
+it RAND 500
+ih meerkat
+swap
+reverseK 3
+sort
+merge
+option poison 4
+rh
+size
+compact
+free
@@ -0,0 +1,23 @@
+# Test of the allocation-site heap profiler
+option fail 0
+option malloc 0
+option heapprof 1
+new
+it RAND 200
+ih gerbil 20
+option asyncfree 1
+new
+it FILE LICENSE
+sort
+dedup
+free
+heapprof bytes /tmp/lab0-trace-30-bytes.folded
+heapprof count /tmp/lab0-trace-30-count.folded
+option asyncfree 0
+rh gerbil
+heapprof live /tmp/lab0-trace-30-live.folded
+heapprof reset
+option heapprof 0
+it bear
+heapprof peak /tmp/lab0-trace-30-peak.folded
+free
@@ -0,0 +1,15 @@
+# Test of the per-command latency profile
+option fail 0
+option malloc 0
+new
+it RAND 1000
+ih dolphin 10
+sort
+reverse
+time sort
+profile
+profile reset
+rh
+it gerbil
+profile
+free
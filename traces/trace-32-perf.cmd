@@ -0,0 +1,11 @@
+# Test of hardware counters, which are simply not shown where unavailable
+option fail 0
+option malloc 0
+option perf 1
+new
+it RAND 1000
+sort
+reverse
+option perf 0
+sort
+free
@@ -0,0 +1,16 @@
+# Test of the latency histograms of insertions and removals
+option fail 0
+option malloc 0
+hist
+option hist 1
+new
+ih RAND 1000
+it gerbil 100
+rh
+rt gerbil
+hist
+hist reset
+option hist 0
+rh
+hist
+free
@@ -0,0 +1,14 @@
+# Test of sorting through temporary files when reading them back fails
+option fail 1000
+option malloc 0
+option sortmem 1
+new
+it RAND 5000
+option malloc 30
+sort
+option descend 1
+sort
+option malloc 0
+size
+free
+option sortmem 0
@@ -0,0 +1,19 @@
+# Test of a large queue in the lean layout, mixed with the default layout
+option fail 0
+option malloc 0
+option lean 1
+new
+it lean 1000000
+size
+option lean 0
+ih plain 1000
+option lean 1
+ih lean
+size
+rh lean
+rh plain
+rt lean
+sort
+size
+free
+option lean 0